@@ -11,6 +11,7 @@
 #include "object.hh"
 #include "insdata.hh"
 #include "precompile.hh"
+#include "romaddr.hh"
 
 bool A_16bit = true;
 bool X_16bit = true;
@@ -287,6 +288,9 @@ GotLabel:
             else if (tok == ".highrom") {
                 address_type = 3;
             }
+            else if (tok == ".fastrom") {
+                SetFastROM(true);
+            }
             else if (tok == ".incbin") {
                 // TODO: read filename & open !
                 fprintf(stderr, "(EE) %s\n", "incbin not supported yet");
@@ -504,11 +508,33 @@ GotLabel:
                                     p1.exp.reset();
                                     break;
                                 }
+                                case 30: // .link hot
+                                {
+                                    result.Linkage.SetHot();
+                                    break;
+                                }
                                 default:
                                     // shouldn't happen
                                     break;
                             }
                         }
+                        else if(op == "la" || op == "lc")
+                        {
+                            /* .align $100, .nocross $100 */
+                            unsigned value = ParseConst(p1, result);
+                            p1.exp.reset();
+                            
+                            if(value == 0 || (value & (value-1)) || value > 0x10000)
+                            {
+                                fprintf(stderr,
+                                    "Error: %s must be a power of 2, at most $10000 - got $%X (%d)\n",
+                                    op == "la" ? ".align" : ".nocross", value, current_line);
+                            }
+                            else if(op == "la")
+                                result.Linkage.SetAlignment(value);
+                            else
+                                result.Linkage.SetNoCross(value);
+                        }
                         else if(op == "np")
                         {
                             switch(addrmode)
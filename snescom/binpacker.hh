@@ -28,20 +28,25 @@
 // This produces quite good results in general cases
 // in O(n*log(n)) complexity, but may sometimes fail
 // when all bins have very little space.
-
-// Users are welcomed to improve the algorithm.
+//
+// When that happens and time is given for it, a branch
+// and bound search looks for a placement that leaves out
+// fewer items, and then one that uses fewer bins. If the
+// search runs to the end, the result is the best there is.
 
 template<typename sizetype>
 // Return value: itemno=>binno
 const std::vector<unsigned> PackBins
 (
    const std::vector<sizetype> &bins, // binno=>size
-   const std::vector<sizetype> &items // itemno=>size
+   const std::vector<sizetype> &items, // itemno=>size
+   double seconds = 0.0 // time for improving a failed packing
 );
 
 // User should verify the results:
 //  result.size() is always guaranteed to be items.size(),
-//  but bins might be overfilled.
+//  but bins might be overfilled, and items that fit nowhere
+//  may be given a binno that is not smaller than bins.size().
 
 // Implementation is in binpacker.tcc .
 #include "binpacker.tcc"
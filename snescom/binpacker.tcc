@@ -10,6 +10,12 @@
 #include <set>
 #include <algorithm>
 
+#ifdef WIN32
+# include <ctime>
+#else
+# include <sys/time.h>
+#endif
+
 #if BINPACKER_DUMP
 #include <iostream>
 #include <iomanip>
@@ -17,10 +23,152 @@
 
 namespace
 {
+    static const unsigned BinPackerNowhere = static_cast<unsigned>(-1);
+    
+    inline double BinPackerTime()
+    {
+#ifdef WIN32
+        return std::clock() / (double)CLOCKS_PER_SEC;
+#else
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+#endif
+    }
+    
+    /* Branch and bound: places the items (biggest first)
+     * leaving out as few as possible, and then using as
+     * few holes as possible. Gives up when time runs out.
+     */
+    template<typename sizetype>
+    class BinSearch
+    {
+    public:
+        BinSearch(const std::vector<sizetype> &Holes,
+                  const std::vector<sizetype> &Items,
+                  double seconds)
+            : items(Items), space(Holes), count(Holes.size(), 0),
+              current(Items.size(), BinPackerNowhere), best(),
+              best_failed(0), best_used(0), found(false),
+              tail(Items.size()+1, 0),
+              deadline(BinPackerTime() + seconds), nodes(0), timeout(false)
+        {
+            for(unsigned a=(unsigned)Items.size(); a-- > 0; )
+                tail[a] = tail[a+1] + Items[a];
+        }
+        
+        /* Returns true if something better than the
+         * given number of failures and used holes was found.
+         */
+        bool Run(unsigned failed, unsigned used)
+        {
+            best_failed = failed;
+            best_used   = used;
+            Search(0, 0, 0);
+            return found;
+        }
+        
+        /* itemno=>holeno, BinPackerNowhere for those left out */
+        const std::vector<unsigned>& GetResult() const { return best; }
+        
+    private:
+        const std::vector<sizetype> &items;
+        std::vector<sizetype> space;   // room left in each hole
+        std::vector<unsigned> count;   // items in each hole
+        std::vector<unsigned> current, best;
+        unsigned best_failed, best_used;
+        bool found;
+        std::vector<sizetype> tail;    // tail[n] = total size of items n..
+        double deadline;
+        unsigned long nodes;
+        bool timeout;
+        
+        /* How many of the items from itemno on must be left out at least */
+        unsigned FailBound(unsigned itemno) const
+        {
+            sizetype room = 0, biggest = 0;
+            for(unsigned b=0; b<space.size(); ++b)
+            {
+                room += space[b];
+                if(space[b] > biggest) biggest = space[b];
+            }
+            /* Those bigger than any hole */
+            unsigned toobig = itemno;
+            while(toobig < items.size() && items[toobig] > biggest) ++toobig;
+            toobig -= itemno;
+            
+            /* Leaving out the biggest ones until the rest would fit */
+            unsigned excess = itemno;
+            while(excess < items.size() && tail[excess] > room) ++excess;
+            excess -= itemno;
+            
+            return toobig > excess ? toobig : excess;
+        }
+        
+        void Search(unsigned itemno, unsigned failed, unsigned used)
+        {
+            if(timeout) return;
+            if(!(++nodes & 1023) && BinPackerTime() > deadline)
+            {
+                timeout = true;
+                return;
+            }
+            
+            if(itemno == items.size())
+            {
+                if(failed < best_failed
+                || (failed == best_failed && used < best_used))
+                {
+                    best_failed = failed;
+                    best_used   = used;
+                    best        = current;
+                    found       = true;
+                }
+                return;
+            }
+            
+            unsigned bound = failed + FailBound(itemno);
+            if(bound > best_failed
+            || (bound == best_failed && used >= best_used)) return;
+            
+            /* Try the holes where it fits, fullest first. Holes that
+             * have the same room and are equally empty are alike,
+             * so only one of them needs to be tried.
+             */
+            const sizetype size = items[itemno];
+            std::vector<std::pair<sizetype, unsigned> > choices;
+            for(unsigned b=0; b<space.size(); ++b)
+                if(space[b] >= size)
+                    choices.push_back(std::make_pair(space[b], b));
+            std::sort(choices.begin(), choices.end());
+            
+            bool tried_empty = false, tried_used = false;
+            for(unsigned c=0; c<choices.size(); ++c)
+            {
+                if(c > 0 && choices[c].first != choices[c-1].first)
+                    tried_empty = tried_used = false;
+                
+                unsigned b = choices[c].second;
+                bool& tried = count[b] ? tried_used : tried_empty;
+                if(tried) continue;
+                tried = true;
+                
+                unsigned newused = used + (count[b] ? 0 : 1);
+                space[b] -= size; ++count[b];
+                current[itemno] = b;
+                Search(itemno+1, failed, newused);
+                space[b] += size; --count[b];
+            }
+            
+            /* Or leave it out */
+            current[itemno] = BinPackerNowhere;
+            Search(itemno+1, failed+1, used);
+        }
+    };
+    
     template<typename sizetype>
     class BinPacker
     {
-        static const unsigned BinPackerNowhere = static_cast<unsigned>(-1);
     public:
         BinPacker
         (
@@ -31,6 +179,9 @@ namespace
         );
         
         const std::vector<unsigned> GetResult() const;
+        
+        /* If some items did not fit, searches for a better placement */
+        void Improve(double seconds);
 
 #if BINPACKER_DUMP
         void Dump() const;
@@ -46,6 +197,7 @@ namespace
         {
             unsigned index, location;
             sizetype size;
+            bool fits; // whether Shuffle() found room for it
             bool operator< (const item &b) const { return size > b.size; }
         };
         std::vector<hole> holes;
@@ -76,6 +228,7 @@ namespace
             items[a].index    = a;
             items[a].size     = Items[a];
             items[a].location = BinPackerNowhere;
+            items[a].fits     = false;
         }
         for(unsigned a=0; a<Holes.size(); ++a)
         {
@@ -137,33 +290,67 @@ namespace
         
         sort(items.begin(), items.end());
         
+        /* The holes by free space, and by number when equal.
+         * The first one that the item fits in is the fullest.
+         */
+        typedef std::set<std::pair<sizetype, unsigned> > freeindex;
+        freeindex byfree;
+        for(unsigned b=0; b<holes.size(); ++b)
+            byfree.insert(std::make_pair(holes[b].size, b));
+        
         for(unsigned a=0; a<items.size(); ++a)
         {
             unsigned besthole=0;
-            sizetype bestfree=0;
-            bool first=true;
-            for(unsigned b=0; b<holes.size(); ++b)
-            {
-                if(holes[b].used+items[a].size > holes[b].size) continue;
-                sizetype free = holes[b].size - holes[b].used;
-                
-                /* free = holes.size()-b;
-                 * ^ use to prefer last holes
-                 */
-                
-                if(first || free < bestfree)
-                {
-                    first = false;
-                    besthole = b;
-                    bestfree = free;
-                }
-            }
+            typename freeindex::iterator i =
+                byfree.lower_bound(std::make_pair(items[a].size, 0U));
+            if(i != byfree.end())
+                besthole = i->second;
+            items[a].fits = i != byfree.end();
+            
+            /* If it fits nowhere, it goes to the first hole anyway */
+            hole& h = holes[besthole];
+            if(h.used <= h.size)
+                byfree.erase(std::make_pair(h.size - h.used, besthole));
+            
             MoveItem(a, besthole);
+            
+            if(h.used <= h.size)
+                byfree.insert(std::make_pair(h.size - h.used, besthole));
         }
         if(IsGood()) return; // No need to push further
         
     }
 
+    template<typename sizetype>
+    void BinPacker<sizetype>::Improve(double seconds)
+    {
+        if(seconds <= 0 || IsGood()) return;
+        
+        /* How well Shuffle() did */
+        unsigned failed = 0, used = 0;
+        std::vector<bool> usedhole(holes.size());
+        for(unsigned a=0; a<items.size(); ++a)
+        {
+            if(!items[a].fits) { ++failed; continue; }
+            if(!usedhole[items[a].location]) ++used;
+            usedhole[items[a].location] = true;
+        }
+        
+        std::vector<sizetype> Holes(holes.size()), Items(items.size());
+        for(unsigned a=0; a<holes.size(); ++a) Holes[a] = holes[a].size;
+        for(unsigned a=0; a<items.size(); ++a) Items[a] = items[a].size;
+        
+        BinSearch<sizetype> search(Holes, Items, seconds);
+        if(!search.Run(failed, used)) return;
+        
+        const std::vector<unsigned>& result = search.GetResult();
+        for(unsigned a=0; a<items.size(); ++a)
+        {
+            MoveItem(a, result[a]);
+            items[a].fits = result[a] != BinPackerNowhere;
+        }
+    }
+
 #if BINPACKER_DUMP
     template<typename sizetype>
     void BinPacker<sizetype>::Dump() const
@@ -214,9 +401,11 @@ namespace
 template<typename sizetype>
 const std::vector<unsigned> PackBins
    (const std::vector<sizetype> &Bins,
-    const std::vector<sizetype> &Items)
+    const std::vector<sizetype> &Items,
+    double seconds)
 {
     BinPacker<sizetype> packer(Bins, Items);
+    packer.Improve(seconds);
 #if BINPACKER_DUMP
     if(!packer.IsGood()) packer.Dump();
 #endif
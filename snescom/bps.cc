@@ -0,0 +1,303 @@
+#include <cstdio>
+
+#include "bps.hh"
+#include "checksum.hh"
+
+/* beat/BPS patch writer.
+ *
+ * The patch is a sequence of actions, each of which produces
+ * a run of target bytes:
+ *
+ *   SourceRead: copy from the same offset in the source
+ *   TargetRead: literal bytes follow in the patch
+ *   SourceCopy: copy from anywhere in the source
+ *   TargetCopy: copy from earlier in the target (may overlap)
+ *
+ * Candidate positions for the copy actions are located through
+ * hash chains keyed by the next four bytes, so the encoder runs
+ * in roughly linear time even for multi-megabyte ROMs.
+ */
+
+namespace
+{
+    enum
+    {
+        SourceRead = 0,
+        TargetRead = 1,
+        SourceCopy = 2,
+        TargetCopy = 3
+    };
+
+    /* Matches shorter than this are not worth an action */
+    const unsigned MinMatch   = 4;
+    /* A source read this long is taken without looking further */
+    const unsigned GoodEnough = 64;
+    /* How many earlier positions are tried per hash bucket */
+    const unsigned MaxChain   = 24;
+    const unsigned HashBits   = 18;
+    const unsigned NoPos      = ~0U;
+
+    inline unsigned HashAt(const unsigned char* p)
+    {
+        unsigned v = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+        return (v * 2654435761U) >> (32 - HashBits);
+    }
+
+    inline unsigned MatchLength(const unsigned char* a, const unsigned char* b, unsigned max)
+    {
+        unsigned n = 0;
+        while(n < max && a[n] == b[n]) ++n;
+        return n;
+    }
+
+    /* Bytes needed to store n as a BPS variable-length number */
+    inline unsigned NumberSize(unsigned long long n)
+    {
+        unsigned result = 1;
+        while(n >= 0x80) { n = (n >> 7) - 1; ++result; }
+        return result;
+    }
+
+    /* Hash chains over a buffer. For each hash, the most recently
+     * inserted position; for each position, the previous position
+     * that had the same hash.
+     */
+    class MatchIndex
+    {
+        std::vector<unsigned> head;
+        std::vector<unsigned> prev;
+        const unsigned char* data;
+        unsigned size;
+    public:
+        MatchIndex(const unsigned char* d, unsigned s)
+            : head(1U << HashBits, NoPos), prev(s, NoPos), data(d), size(s) { }
+
+        void Insert(unsigned pos)
+        {
+            if(pos + MinMatch > size) return;
+            unsigned h = HashAt(data + pos);
+            prev[pos] = head[h];
+            head[h]   = pos;
+        }
+        unsigned First(const unsigned char* p) const { return head[HashAt(p)]; }
+        unsigned Next(unsigned pos) const { return prev[pos]; }
+    };
+
+    class BPSencoder
+    {
+        std::vector<unsigned char> patch;
+
+        const unsigned char* s; unsigned ssize;
+        const unsigned char* t; unsigned tsize;
+
+        unsigned sourceRelative, targetRelative;
+        unsigned literalBegin, literalCount;
+    public:
+        BPSencoder(const std::vector<unsigned char>& source,
+                   const std::vector<unsigned char>& target)
+            : patch(),
+              s(source.empty() ? NULL : &source[0]), ssize((unsigned)source.size()),
+              t(target.empty() ? NULL : &target[0]), tsize((unsigned)target.size()),
+              sourceRelative(0), targetRelative(0),
+              literalBegin(0), literalCount(0)
+        {
+        }
+
+        const std::vector<unsigned char>& Encode(const std::string& metadata);
+
+    private:
+        void PutNumber(unsigned long long n)
+        {
+            for(;;)
+            {
+                unsigned char x = n & 0x7F;
+                n >>= 7;
+                if(!n) { patch.push_back(0x80 | x); break; }
+                patch.push_back(x);
+                --n;
+            }
+        }
+        void PutDWord(unsigned v)
+        {
+            patch.push_back(v & 0xFF);
+            patch.push_back((v >> 8) & 0xFF);
+            patch.push_back((v >> 16) & 0xFF);
+            patch.push_back((unsigned char)(v >> 24));
+        }
+        void PutAction(unsigned mode, unsigned length)
+        {
+            PutNumber(((unsigned long long)(length-1) << 2) | mode);
+        }
+        static unsigned long long OffsetCode(unsigned to, unsigned relative)
+        {
+            if(to >= relative) return (unsigned long long)(to - relative) << 1;
+            return ((unsigned long long)(relative - to) << 1) | 1;
+        }
+        void FlushLiterals()
+        {
+            if(!literalCount) return;
+            PutAction(TargetRead, literalCount);
+            patch.insert(patch.end(), t + literalBegin, t + literalBegin + literalCount);
+            literalCount = 0;
+        }
+    };
+
+    const std::vector<unsigned char>& BPSencoder::Encode(const std::string& metadata)
+    {
+        patch.clear();
+        patch.reserve(tsize / 16 + 64);
+
+        patch.push_back('B'); patch.push_back('P');
+        patch.push_back('S'); patch.push_back('1');
+        PutNumber(ssize);
+        PutNumber(tsize);
+        PutNumber(metadata.size());
+        patch.insert(patch.end(), metadata.begin(), metadata.end());
+
+        MatchIndex sindex(s, ssize);
+        for(unsigned a=0; a+MinMatch <= ssize; ++a) sindex.Insert(a);
+
+        /* Target positions are indexed as they are passed,
+         * so that every TargetCopy refers to earlier output.
+         */
+        MatchIndex tindex(t, tsize);
+
+        for(unsigned pos=0; pos<tsize; )
+        {
+            const unsigned left = tsize - pos;
+
+            unsigned bestmode = TargetRead;
+            unsigned bestlen  = 0;
+            unsigned bestfrom = 0;
+            int      bestgain = 0;
+
+            if(pos < ssize)
+            {
+                unsigned max = ssize - pos;
+                if(max > left) max = left;
+                unsigned n = MatchLength(s + pos, t + pos, max);
+                int gain = (int)n - (int)NumberSize((unsigned long long)(n ? n-1 : 0) << 2);
+                if(n >= MinMatch && gain > bestgain)
+                {
+                    bestmode = SourceRead;
+                    bestlen  = n;
+                    bestgain = gain;
+                }
+            }
+
+            if(bestlen < GoodEnough && left >= MinMatch)
+            {
+                unsigned chain = MaxChain;
+                for(unsigned c = ssize >= MinMatch ? sindex.First(t + pos) : NoPos;
+                    c != NoPos && chain > 0;
+                    c = sindex.Next(c), --chain)
+                {
+                    if(c == pos) continue; /* That's a SourceRead */
+                    unsigned max = ssize - c;
+                    if(max > left) max = left;
+                    if(max <= bestlen) continue;
+                    unsigned n = MatchLength(s + c, t + pos, max);
+                    if(n < MinMatch) continue;
+                    int gain = (int)n
+                             - (int)NumberSize((unsigned long long)(n-1) << 2)
+                             - (int)NumberSize(OffsetCode(c, sourceRelative));
+                    if(gain > bestgain)
+                    {
+                        bestmode = SourceCopy;
+                        bestlen  = n;
+                        bestfrom = c;
+                        bestgain = gain;
+                    }
+                }
+
+                chain = MaxChain;
+                for(unsigned c = tindex.First(t + pos);
+                    c != NoPos && chain > 0;
+                    c = tindex.Next(c), --chain)
+                {
+                    unsigned max = left;
+                    if(max <= bestlen) break;
+                    unsigned n = MatchLength(t + c, t + pos, max);
+                    if(n < MinMatch) continue;
+                    int gain = (int)n
+                             - (int)NumberSize((unsigned long long)(n-1) << 2)
+                             - (int)NumberSize(OffsetCode(c, targetRelative));
+                    if(gain > bestgain)
+                    {
+                        bestmode = TargetCopy;
+                        bestlen  = n;
+                        bestfrom = c;
+                        bestgain = gain;
+                    }
+                }
+            }
+
+            if(bestgain <= 0)
+            {
+                if(!literalCount) literalBegin = pos;
+                ++literalCount;
+                tindex.Insert(pos);
+                ++pos;
+                continue;
+            }
+
+            FlushLiterals();
+            PutAction(bestmode, bestlen);
+            switch(bestmode)
+            {
+                case SourceCopy:
+                    PutNumber(OffsetCode(bestfrom, sourceRelative));
+                    sourceRelative = bestfrom + bestlen;
+                    break;
+                case TargetCopy:
+                    PutNumber(OffsetCode(bestfrom, targetRelative));
+                    targetRelative = bestfrom + bestlen;
+                    break;
+            }
+
+            /* Unchanged regions are found again through the
+             * source index, so they need not be indexed twice.
+             */
+            if(bestmode != SourceRead)
+                for(unsigned a=0; a<bestlen; ++a)
+                    tindex.Insert(pos + a);
+            pos += bestlen;
+        }
+        FlushLiterals();
+
+        PutDWord(CRC32(s, ssize));
+        PutDWord(CRC32(t, tsize));
+        PutDWord(CRC32(&patch[0], patch.size()));
+        return patch;
+    }
+}
+
+void WriteBPS(std::FILE* fp,
+              const std::vector<unsigned char>& source,
+              const std::vector<unsigned char>& target,
+              const std::string& metadata)
+{
+    BPSencoder encoder(source, target);
+    const std::vector<unsigned char>& patch = encoder.Encode(metadata);
+    std::fwrite(&patch[0], 1, patch.size(), fp);
+}
+
+bool LoadBinaryFile(const std::string& filename, std::vector<unsigned char>& result)
+{
+    std::FILE* fp = std::fopen(filename.c_str(), "rb");
+    if(!fp)
+    {
+        std::perror(filename.c_str());
+        return false;
+    }
+    std::fseek(fp, 0, SEEK_END);
+    long size = std::ftell(fp);
+    std::rewind(fp);
+
+    result.resize(size > 0 ? size : 0);
+    bool ok = result.empty()
+           || std::fread(&result[0], 1, result.size(), fp) == result.size();
+    if(!ok) std::perror(filename.c_str());
+    std::fclose(fp);
+    return ok;
+}
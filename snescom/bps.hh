@@ -0,0 +1,24 @@
+#ifndef bqtBPShh
+#define bqtBPShh
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* beat/BPS delta patch writer.
+ *
+ * Unlike IPS, BPS has no 16 MB offset limit, and it
+ * carries CRC32s of the source, the target and the patch.
+ *
+ * The source may be empty, in which case the patch
+ * simply creates the target from nothing.
+ */
+void WriteBPS(std::FILE* fp,
+              const std::vector<unsigned char>& source,
+              const std::vector<unsigned char>& target,
+              const std::string& metadata = "");
+
+/* Loads a whole file into memory. Returns false on error. */
+bool LoadBinaryFile(const std::string& filename, std::vector<unsigned char>& result);
+
+#endif
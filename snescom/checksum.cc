@@ -0,0 +1,108 @@
+#include "checksum.hh"
+
+namespace
+{
+    /* Tables for the slice-by-8 algorithm.
+     * Table[0] is the classic bytewise table, and
+     * Table[n] advances the CRC of Table[n-1] by one zero byte.
+     */
+    class CRC32tables
+    {
+    public:
+        unsigned Table[8][256];
+    public:
+        CRC32tables()
+        {
+            for(unsigned a=0; a<256; ++a)
+            {
+                unsigned c = a;
+                for(unsigned k=0; k<8; ++k)
+                    c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+                Table[0][a] = c;
+            }
+            for(unsigned a=0; a<256; ++a)
+                for(unsigned n=1; n<8; ++n)
+                {
+                    unsigned c = Table[n-1][a];
+                    Table[n][a] = (c >> 8) ^ Table[0][c & 0xFF];
+                }
+        }
+    };
+
+    const CRC32tables& GetTables()
+    {
+        static const CRC32tables tables;
+        return tables;
+    }
+}
+
+unsigned CRC32(const unsigned char* data, unsigned long length, unsigned crc)
+{
+    const unsigned (*const t)[256] = GetTables().Table;
+
+    crc = ~crc;
+
+    /* Eight bytes at a time. Bytes are assembled by hand
+     * so that this works regardless of endianness and alignment.
+     */
+    for(; length >= 8; length -= 8, data += 8)
+    {
+        crc ^= data[0]
+            | (data[1] << 8)
+            | (data[2] << 16)
+            | ((unsigned)data[3] << 24);
+        crc = t[7][ crc        & 0xFF]
+            ^ t[6][(crc >>  8) & 0xFF]
+            ^ t[5][(crc >> 16) & 0xFF]
+            ^ t[4][ crc >> 24        ]
+            ^ t[3][data[4]]
+            ^ t[2][data[5]]
+            ^ t[1][data[6]]
+            ^ t[0][data[7]];
+    }
+
+    /* The leftovers one at a time */
+    while(length-- > 0)
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+# include <immintrin.h>
+#endif
+
+unsigned long ByteSum(const unsigned char* data, unsigned long length)
+{
+    unsigned long result = 0;
+
+#if defined(__AVX2__) && defined(__x86_64__)
+    /* psadbw against zero adds up groups of eight bytes
+     * into 64-bit lanes, which cannot overflow here.
+     */
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for(; length >= 32; length -= 32, data += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)data);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+    }
+    __m128i acc128 = _mm_add_epi64(_mm256_castsi256_si128(acc),
+                                   _mm256_extracti128_si256(acc, 1));
+    result += (unsigned long)_mm_cvtsi128_si64(acc128)
+            + (unsigned long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc128, acc128));
+#elif defined(__SSE2__) && defined(__x86_64__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for(; length >= 16; length -= 16, data += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)data);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    result += (unsigned long)_mm_cvtsi128_si64(acc)
+            + (unsigned long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#endif
+
+    while(length-- > 0) result += *data++;
+    return result;
+}
@@ -0,0 +1,15 @@
+#ifndef bqtChecksumHH
+#define bqtChecksumHH
+
+/* CRC-32 (the zlib/PNG/BPS polynomial, 0xEDB88320 reflected).
+ * Pass the previous return value as "crc" to continue
+ * a checksum over several buffers.
+ */
+unsigned CRC32(const unsigned char* data, unsigned long length, unsigned crc = 0);
+
+/* Sum of all bytes, as used by the SNES header checksum.
+ * Uses SSE2 or AVX2 when the compiler targets them.
+ */
+unsigned long ByteSum(const unsigned char* data, unsigned long length);
+
+#endif
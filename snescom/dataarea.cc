@@ -109,9 +109,8 @@ const std::vector<unsigned char> DataArea::GetContent() const
     return result;
 }
 
-const std::vector<unsigned char> DataArea::GetContent(unsigned begin, unsigned size) const
+void DataArea::CopyTo(unsigned begin, unsigned size, unsigned char* result) const
 {
-    std::vector<unsigned char> result(size, Empty);
 
     for(map::const_iterator i = blobs.begin(); i != blobs.end(); ++i)
     {
@@ -165,8 +164,14 @@ const std::vector<unsigned char> DataArea::GetContent(unsigned begin, unsigned s
 
         std::copy(i->second.begin() + pos,
                   i->second.begin() + pos + count,
-                  result.begin() + target);
+                  result + target);
     }
+}
+
+const std::vector<unsigned char> DataArea::GetContent(unsigned begin, unsigned size) const
+{
+    std::vector<unsigned char> result(size, Empty);
+    if(size) CopyTo(begin, size, &result[0]);
     return result;
 }
 
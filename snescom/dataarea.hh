@@ -34,6 +34,11 @@ public:
     const std::vector<unsigned char> GetContent() const;
     
     const std::vector<unsigned char> GetContent(unsigned begin, unsigned size) const;
+    
+    /* Like GetContent(), but copies into the given memory.
+     * Bytes that don't exist are left untouched.
+     */
+    void CopyTo(unsigned begin, unsigned size, unsigned char* target) const;
 };
 
 #endif
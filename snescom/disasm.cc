@@ -182,7 +182,7 @@ static void O65dumpSeg(const O65& o65, SegmentSelection seg, const char* asmhead
 static int HandleO65()
 {
     O65 o65;
-    o65.Load(stdin);
+    if(!o65.Load(stdin)) return -1;
 
     RelocVarList = o65.GetExternList();
     for(unsigned a=0; a<RelocVarList.size(); ++a)
@@ -0,0 +1,95 @@
+#include "freescan.hh"
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+namespace
+{
+    /* Number of the lowest set bit; m must not be 0 */
+    inline unsigned LowestBit(unsigned m)
+    {
+#ifdef __GNUC__
+        return __builtin_ctz(m);
+#else
+        unsigned n = 0;
+        while(!(m & 1)) { m >>= 1; ++n; }
+        return n;
+#endif
+    }
+    
+    /* Bit n is set if data[n] == fill */
+    inline unsigned FillMask16(const unsigned char* data, unsigned char fill)
+    {
+#ifdef __SSE2__
+        __m128i bytes = _mm_loadu_si128((const __m128i*)data);
+        __m128i match = _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)fill));
+        return (unsigned)_mm_movemask_epi8(match);
+#else
+        unsigned m = 0;
+        for(unsigned a=0; a<16; ++a)
+            if(data[a] == fill) m |= 1U << a;
+        return m;
+#endif
+    }
+    
+    class RunFinder
+    {
+        unsigned minlength;
+        std::vector<std::pair<unsigned, unsigned> >& runs;
+        bool     in_run;
+        unsigned run_begin;
+    public:
+        RunFinder(unsigned min, std::vector<std::pair<unsigned, unsigned> >& r)
+            : minlength(min), runs(r), in_run(false), run_begin(0) { }
+        
+        /* Takes the mask of width bytes beginning at pos */
+        void Feed(unsigned pos, unsigned mask, unsigned width)
+        {
+            const unsigned all = width >= 32 ? ~0U : (1U << width) - 1;
+            mask &= all;
+            
+            /* The common cases: nothing changes within the block */
+            if(mask == (in_run ? all : 0)) return;
+            
+            for(unsigned n = 0; n < width; )
+            {
+                unsigned rest = (in_run ? ~mask & all : mask) >> n;
+                if(!rest) break;
+                n += LowestBit(rest);
+                if(in_run)
+                    End(pos + n);
+                else
+                {
+                    in_run    = true;
+                    run_begin = pos + n;
+                }
+            }
+        }
+        
+        void End(unsigned pos)
+        {
+            if(in_run && pos - run_begin >= minlength)
+                runs.push_back(std::make_pair(run_begin, pos - run_begin));
+            in_run = false;
+        }
+    };
+}
+
+void FindFillRuns(const unsigned char* data, unsigned size,
+                  unsigned char fill, unsigned minlength,
+                  std::vector<std::pair<unsigned, unsigned> >& runs)
+{
+    RunFinder finder(minlength ? minlength : 1, runs);
+    
+    unsigned pos = 0;
+    for(; pos + 16 <= size; pos += 16)
+        finder.Feed(pos, FillMask16(data + pos, fill), 16);
+    
+    unsigned mask = 0;
+    for(unsigned a=0; pos + a < size; ++a)
+        if(data[pos + a] == fill) mask |= 1U << a;
+    finder.Feed(pos, mask, size - pos);
+    
+    finder.End(size);
+}
@@ -0,0 +1,18 @@
+#ifndef bqtFreeScanHH
+#define bqtFreeScanHH
+
+#include <vector>
+#include <utility>
+
+/* Finds the runs of at least minlength bytes that all have
+ * the value fill. The result is a list of (offset, length)
+ * pairs, in order.
+ *
+ * The data is looked at 16 bytes at a time, with SSE2
+ * where it is available.
+ */
+void FindFillRuns(const unsigned char* data, unsigned size,
+                  unsigned char fill, unsigned minlength,
+                  std::vector<std::pair<unsigned, unsigned> >& runs);
+
+#endif
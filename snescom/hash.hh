@@ -1,90 +1,256 @@
 #ifndef bqtHashHH
 #define bqtHashHH
 
-/* Set to 0 if you have compilation problems
- * with hash_set or hash_map
- */
-#define USE_HASH 1
+#include <string>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <cstring>
+#include <cstdio>
 
+/* A fast 64-bit string hash: eight bytes at a time,
+ * with a murmur3-style finalizer so that all bits count.
+ */
+inline unsigned long long HashString(const char* s, unsigned long n)
+{
+    const unsigned long long K = 0x9E3779B97F4A7C15ULL;
+    unsigned long long h = n * K;
 
-#if USE_HASH
+    while(n >= 8)
+    {
+        unsigned long long w;
+        std::memcpy(&w, s, 8);
+        h = (h ^ (w * K)) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+        s += 8; n -= 8;
+    }
+    unsigned long long w = 0;
+    for(unsigned a=0; a<n; ++a)
+        w |= (unsigned long long)(unsigned char)s[a] << (a*8);
+    h = (h ^ (w * K)) * 0xBF58476D1CE4E5B9ULL;
 
-#include <cwchar>
-#include <string>
+    h ^= h >> 33; h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+inline unsigned long long HashString(const std::string& s)
+{
+    return HashString(s.data(), s.size());
+}
 
-#include <ext/hash_map>
-#include <ext/hash_set>
-using namespace __gnu_cxx;
+/* How well a hash table is doing */
+struct HashStats
+{
+    unsigned long size;       // number of keys
+    unsigned long capacity;   // number of slots
+    unsigned long collisions; // keys not in their first slot
+    unsigned long probes;     // total probe length of all keys
+    unsigned long max_probe;  // longest probe length
 
-using std::basic_string;
+    HashStats(): size(0),capacity(0),collisions(0),probes(0),max_probe(0) { }
 
-struct BitSwapHashFon
-{
-  size_t operator() (unsigned n) const
-  {
-    unsigned rot = n&31;
-    return (n << rot) | (n >> (32-rot));
-  }
+    void Add(const HashStats& b)
+    {
+        size += b.size; capacity += b.capacity;
+        collisions += b.collisions; probes += b.probes;
+        if(b.max_probe > max_probe) max_probe = b.max_probe;
+    }
+    
+    void Print(std::FILE* fp, const char* title) const
+    {
+        std::fprintf(fp,
+            "%s: %lu name(s) in %lu slot(s), %lu collision(s),"
+            " average probe length %.2f, longest %lu\n",
+            title, size, capacity, collisions,
+            size ? (double)probes / (double)size : 0.0, max_probe);
+    }
 };
 
-namespace __gnu_cxx
+/* A string-keyed hash map in a single flat array, with
+ * linear probing. Lookups may also be done with a pointer
+ * and a length, so there is no need to build a std::string
+ * for looking up a part of a string.
+ *
+ * Iteration order is unspecified. Inserting invalidates
+ * iterators; erasing invalidates the ones after it.
+ */
+template<typename Value>
+class StringHashMap
 {
-  template<typename T>
-  struct hash<basic_string<T> >
-  {
-    size_t operator() (const basic_string<T> &s) const
+public:
+    typedef std::pair<std::string, Value> value_type;
+
+private:
+    struct Slot
+    {
+        value_type kv;
+        unsigned   hash; // low bits of the hash; 0 = empty
+
+        Slot(): kv(), hash(0) { }
+    };
+    std::vector<Slot> slots; // size is 0 or a power of 2
+    unsigned long count;
+
+    static unsigned SlotHash(const char* s, unsigned long n)
     {
-        unsigned h=0;
-        for(unsigned a=0,b=s.size(); a<b; ++a)
+        unsigned h = (unsigned)HashString(s, n);
+        return h ? h : 1;
+    }
+    unsigned long Mask() const { return slots.size() - 1; }
+
+    /* Returns the slot of the key, or of the empty slot where it would go */
+    unsigned long Locate(const char* s, unsigned long n, unsigned h) const
+    {
+        unsigned long pos = h & Mask();
+        for(;; pos = (pos+1) & Mask())
         {
-            unsigned c = s[a];
-            c=h^c;
-            h^=(c*707106);
+            const Slot& slot = slots[pos];
+            if(!slot.hash) return pos;
+            if(slot.hash == h
+            && slot.kv.first.size() == n
+            && !std::memcmp(slot.kv.first.data(), s, n)) return pos;
         }
-        return h;
     }
-  };
-  template<>
-  struct hash<std::wstring>
-  {
-    size_t operator() (const std::wstring &s) const
+
+    void Grow()
     {
-        unsigned h=0;
-        for(unsigned a=0,b=s.size(); a<b; ++a)
+        std::vector<Slot> old;
+        old.swap(slots);
+        slots.resize(old.empty() ? 16 : old.size() * 2);
+        for(unsigned long a=0; a<old.size(); ++a)
         {
-            unsigned c = s[a];
-            c=h^c;
-            h^=(c*707106);
+            if(!old[a].hash) continue;
+            unsigned long pos = old[a].hash & Mask();
+            while(slots[pos].hash) pos = (pos+1) & Mask();
+            slots[pos].hash = old[a].hash;
+            slots[pos].kv.first.swap(old[a].kv.first);
+            slots[pos].kv.second = old[a].kv.second;
         }
-        return h;
     }
-  };
-  template<>
-  struct hash<wchar_t>
-  {
-    size_t operator() (wchar_t n) const
+
+public:
+    template<typename Map, typename Ptr, typename Ref>
+    class iter
     {
-        /* Since values of n<128 are the most common,
-         * values of n<256 the second common
-         * and big values of n are rare, we rotate some
-         * bits to make the distribution more even.
-         * Multiplying n by 33818641 (a prime near 2^32/127) scales
-         * the numbers nicely to fit the whole range and keeps the
-         * distribution about even.
-         */
-        return (n * 33818641UL);
+        friend class StringHashMap;
+        template<typename M2, typename P2, typename R2> friend class iter;
+        Map* map;
+        unsigned long pos;
+
+        void Skip() { while(pos < map->slots.size() && !map->slots[pos].hash) ++pos; }
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef long       difference_type;
+        typedef std::pair<std::string, Value> value_type;
+        typedef Ptr        pointer;
+        typedef Ref        reference;
+
+        iter(): map(0), pos(0) { }
+        iter(Map* m, unsigned long p): map(m), pos(p) { Skip(); }
+        template<typename M2, typename P2, typename R2>
+        iter(const iter<M2,P2,R2>& b): map(b.map), pos(b.pos) { }
+
+        Ref operator*() const { return map->slots[pos].kv; }
+        Ptr operator->() const { return &map->slots[pos].kv; }
+        iter& operator++() { ++pos; Skip(); return *this; }
+
+        template<typename M2, typename P2, typename R2>
+        bool operator==(const iter<M2,P2,R2>& b) const { return pos == b.pos; }
+        template<typename M2, typename P2, typename R2>
+        bool operator!=(const iter<M2,P2,R2>& b) const { return pos != b.pos; }
+    };
+    typedef iter<StringHashMap, value_type*, value_type&> iterator;
+    typedef iter<const StringHashMap, const value_type*, const value_type&> const_iterator;
+
+    StringHashMap(): slots(), count(0) { }
+
+    unsigned long size() const { return count; }
+    bool empty() const { return !count; }
+    void clear() { slots.clear(); count = 0; }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end()   { return iterator(this, slots.size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end()   const { return const_iterator(this, slots.size()); }
+
+    iterator find(const char* s, unsigned long n)
+    {
+        if(!count) return end();
+        unsigned long pos = Locate(s, n, SlotHash(s, n));
+        return slots[pos].hash ? iterator(this, pos) : end();
     }
-  };
-}
+    const_iterator find(const char* s, unsigned long n) const
+    {
+        if(!count) return end();
+        unsigned long pos = Locate(s, n, SlotHash(s, n));
+        return slots[pos].hash ? const_iterator(this, pos) : end();
+    }
+    iterator find(const std::string& key) { return find(key.data(), key.size()); }
+    const_iterator find(const std::string& key) const { return find(key.data(), key.size()); }
 
-#else
+    Value& operator[] (const std::string& key)
+    {
+        /* Keep the load factor at most 3/4 */
+        if((count+1) * 4 > slots.size() * 3) Grow();
 
-#include <map>
-#include <set>
+        unsigned h = SlotHash(key.data(), key.size());
+        unsigned long pos = Locate(key.data(), key.size(), h);
+        Slot& slot = slots[pos];
+        if(!slot.hash)
+        {
+            slot.hash     = h;
+            slot.kv.first = key;
+            ++count;
+        }
+        return slot.kv.second;
+    }
 
-#define hash_map std::map
-#define hash_set std::set
+    void erase(iterator i)
+    {
+        /* Move the following keys back so that no probe
+         * sequence gets broken by the hole.
+         */
+        unsigned long hole = i.pos;
+        for(unsigned long pos = (hole+1) & Mask(); slots[pos].hash; pos = (pos+1) & Mask())
+        {
+            unsigned long home = slots[pos].hash & Mask();
+            /* Can the key at pos be moved to the hole? */
+            if(((pos - home) & Mask()) >= ((pos - hole) & Mask()))
+            {
+                slots[hole].hash = slots[pos].hash;
+                slots[hole].kv.first.swap(slots[pos].kv.first);
+                slots[hole].kv.second = slots[pos].kv.second;
+                hole = pos;
+            }
+        }
+        slots[hole].hash = 0;
+        slots[hole].kv = value_type();
+        --count;
+    }
+    unsigned long erase(const std::string& key)
+    {
+        iterator i = find(key);
+        if(i == end()) return 0;
+        erase(i);
+        return 1;
+    }
 
-#endif // USE_HASH
+    const HashStats GetStats() const
+    {
+        HashStats result;
+        result.size     = count;
+        result.capacity = slots.size();
+        for(unsigned long pos=0; pos<slots.size(); ++pos)
+        {
+            if(!slots[pos].hash) continue;
+            unsigned long probe = (pos - (slots[pos].hash & Mask())) & Mask();
+            if(probe) ++result.collisions;
+            result.probes += probe + 1;
+            if(probe + 1 > result.max_probe) result.max_probe = probe + 1;
+        }
+        return result;
+    }
+};
 
 #endif // bqtHashHH
@@ -0,0 +1,317 @@
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+#include "incremental.hh"
+#include "checksum.hh"
+
+namespace
+{
+    const char StateMagic[] = "SNLKINC4";
+
+    const SegmentSelection Segs[4] = { CODE, DATA, ZERO, BSS };
+
+    void PutD(unsigned w, std::FILE* fp)
+    {
+        std::fputc(w & 255, fp);
+        std::fputc((w >> 8) & 255, fp);
+        std::fputc((w >> 16) & 255, fp);
+        std::fputc(w >> 24, fp);
+    }
+    void PutS(const std::string& s, std::FILE* fp)
+    {
+        PutD((unsigned)s.size(), fp);
+        std::fwrite(s.data(), 1, s.size(), fp);
+    }
+
+    bool GetD(unsigned& w, std::FILE* fp)
+    {
+        unsigned char Buf[4];
+        if(std::fread(Buf, 1, 4, fp) != 4) return false;
+        w = Buf[0] | (Buf[1] << 8) | (Buf[2] << 16) | ((unsigned)Buf[3] << 24);
+        return true;
+    }
+    bool GetS(std::string& s, std::FILE* fp)
+    {
+        unsigned len;
+        if(!GetD(len, fp) || len > 0x10000) return false;
+        std::vector<char> Buf(len + 1);
+        if(std::fread(&Buf[0], 1, len, fp) != len) return false;
+        s.assign(&Buf[0], len);
+        return true;
+    }
+
+    void CodeRange(const LinkState::ObjectRecord& rec,
+                   std::vector<pair<unsigned, unsigned> >& target)
+    {
+        if(rec.size[0])
+            target.push_back(std::make_pair(rec.addr[0], rec.size[0]));
+    }
+}
+
+LinkState::ObjectRecord::ObjectRecord()
+    : from_o65(false), wish(), linked_crc(0), symbols()
+{
+    for(unsigned s=0; s<4; ++s) addr[s] = size[s] = 0;
+}
+
+LinkState::LinkState()
+    : address_type(0), fastrom(false), output_name(), output_size(0), output_crc(0), objects()
+{
+}
+
+bool LinkState::Load(const std::string& filename)
+{
+    std::FILE* fp = std::fopen(filename.c_str(), "rb");
+    if(!fp) return false;
+
+    LinkState result;
+
+    char Buf[8];
+    bool ok = std::fread(Buf, 1, 8, fp) == 8
+           && !std::memcmp(Buf, StateMagic, 8);
+
+    unsigned type = 0, fastrom = 0, count = 0;
+    ok = ok && GetD(type, fp)
+            && GetD(fastrom, fp)
+            && GetS(result.output_name, fp)
+            && GetD(result.output_size, fp)
+            && GetD(result.output_crc, fp)
+            && GetD(count, fp);
+    result.address_type = type;
+    result.fastrom      = fastrom != 0;
+
+    for(unsigned a=0; ok && a<count; ++a)
+    {
+        std::string key;
+        ObjectRecord rec;
+        unsigned from_o65 = 0, wishtype = 0, hot = 0, nsyms = 0;
+
+        ok = GetS(key, fp)
+          && GetD(from_o65, fp)
+          && GetD(wishtype, fp)
+          && GetD(rec.wish.param, fp)
+          && GetD(rec.wish.align, fp)
+          && GetD(rec.wish.nocross, fp)
+          && GetD(hot, fp);
+        rec.from_o65  = from_o65 != 0;
+        rec.wish.type = (enum LinkageWish::type)wishtype;
+        rec.wish.hot  = hot != 0;
+        for(unsigned s=0; ok && s<4; ++s)
+            ok = GetD(rec.addr[s], fp) && GetD(rec.size[s], fp);
+        ok = ok && GetD(rec.linked_crc, fp)
+                && GetD(nsyms, fp);
+        for(unsigned b=0; ok && b<nsyms; ++b)
+        {
+            pair<std::string, unsigned> sym;
+            ok = GetS(sym.first, fp) && GetD(sym.second, fp);
+            rec.symbols.push_back(sym);
+        }
+        if(ok) result.objects[key] = rec;
+    }
+    std::fclose(fp);
+
+    if(!ok)
+    {
+        std::fprintf(stderr, "O65 linker: %s is not a valid link state file, ignoring it\n",
+            filename.c_str());
+        return false;
+    }
+    *this = result;
+    return true;
+}
+
+bool LinkState::Save(const std::string& filename) const
+{
+    std::FILE* fp = std::fopen(filename.c_str(), "wb");
+    if(!fp)
+    {
+        std::perror(filename.c_str());
+        return false;
+    }
+
+    std::fwrite(StateMagic, 1, 8, fp);
+    PutD(address_type, fp);
+    PutD(fastrom, fp);
+    PutS(output_name, fp);
+    PutD(output_size, fp);
+    PutD(output_crc, fp);
+    PutD((unsigned)objects.size(), fp);
+
+    for(objmap::const_iterator i = objects.begin(); i != objects.end(); ++i)
+    {
+        const ObjectRecord& rec = i->second;
+        PutS(i->first, fp);
+        PutD(rec.from_o65, fp);
+        PutD(rec.wish.type, fp);
+        PutD(rec.wish.param, fp);
+        PutD(rec.wish.align, fp);
+        PutD(rec.wish.nocross, fp);
+        PutD(rec.wish.hot, fp);
+        for(unsigned s=0; s<4; ++s)
+        {
+            PutD(rec.addr[s], fp);
+            PutD(rec.size[s], fp);
+        }
+        PutD(rec.linked_crc, fp);
+        PutD((unsigned)rec.symbols.size(), fp);
+        for(unsigned b=0; b<rec.symbols.size(); ++b)
+        {
+            PutS(rec.symbols[b].first, fp);
+            PutD(rec.symbols[b].second, fp);
+        }
+    }
+
+    bool ok = !std::ferror(fp);
+    if(std::fclose(fp) != 0) ok = false;
+    if(!ok) std::perror(filename.c_str());
+    return ok;
+}
+
+const LinkState::ObjectRecord* LinkState::Find(const std::string& key) const
+{
+    objmap::const_iterator i = objects.find(key);
+    if(i == objects.end()) return NULL;
+    return &i->second;
+}
+
+const std::vector<std::string> GetObjectKeys(const O65linker& linker)
+{
+    std::map<std::string, unsigned> seen;
+
+    std::vector<std::string> result;
+    const unsigned n = linker.GetObjectCount();
+    result.reserve(n);
+    for(unsigned a=0; a<n; ++a)
+    {
+        const std::string& name = linker.GetName(a);
+        char Buf[64];
+        std::sprintf(Buf, "#%u", seen[name]++);
+        result.push_back(name + Buf);
+    }
+    return result;
+}
+
+unsigned PinObjects(O65linker& linker, const LinkState& previous,
+                    const std::vector<std::string>& keys,
+                    const std::vector<bool>& from_o65)
+{
+    const unsigned n = linker.GetObjectCount();
+    const std::vector<LinkageWish> wishes = linker.GetLinkageList(CODE);
+
+    std::vector<const LinkState::ObjectRecord*> records(n);
+    for(unsigned a=0; a<n; ++a)
+        records[a] = from_o65[a] ? previous.Find(keys[a]) : NULL;
+
+    unsigned pinned = 0;
+    for(unsigned s=0; s<4; ++s)
+    {
+        const SegmentSelection seg = Segs[s];
+        const std::vector<unsigned> sizes = linker.GetSizeList(seg);
+        const std::vector<LinkageWish> linkages = linker.GetLinkageList(seg);
+
+        std::vector<bool> pin(n);
+        std::set<unsigned> broken_groups;
+        for(unsigned a=0; a<n; ++a)
+        {
+            const LinkState::ObjectRecord* rec = records[a];
+            if(linkages[a].type == LinkageWish::LinkHere) continue;
+
+            pin[a] = rec
+                  && rec->wish == wishes[a]
+                  && sizes[a] <= rec->size[s];
+
+            if(!pin[a] && seg == CODE
+            && linkages[a].type == LinkageWish::LinkInGroup)
+                broken_groups.insert(linkages[a].GetGroup());
+        }
+
+        for(unsigned a=0; a<n; ++a)
+        {
+            if(!pin[a]) continue;
+            if(seg == CODE
+            && linkages[a].type == LinkageWish::LinkInGroup
+            && broken_groups.find(linkages[a].GetGroup()) != broken_groups.end())
+                continue;
+
+            linker.PutAddr(a, records[a]->addr[s], seg);
+            if(seg == CODE) ++pinned;
+        }
+    }
+    return pinned;
+}
+
+void RecordLinkState(const O65linker& linker, LinkState& state,
+                     const std::vector<std::string>& keys,
+                     const std::vector<bool>& from_o65,
+                     const std::vector<LinkageWish>& wishes)
+{
+    state.objects.clear();
+
+    const unsigned n = linker.GetObjectCount();
+    std::vector<unsigned> addrs[4], sizes[4];
+    for(unsigned s=0; s<4; ++s)
+    {
+        addrs[s] = linker.GetAddrList(Segs[s]);
+        sizes[s] = linker.GetSizeList(Segs[s]);
+    }
+
+    for(unsigned a=0; a<n; ++a)
+    {
+        LinkState::ObjectRecord& rec = state.objects[keys[a]];
+        rec.from_o65  = a < from_o65.size() && from_o65[a];
+        rec.wish      = a < wishes.size() ? wishes[a] : LinkageWish();
+        for(unsigned s=0; s<4; ++s)
+        {
+            rec.addr[s] = addrs[s][a];
+            rec.size[s] = sizes[s][a];
+
+            const std::vector<pair<std::string, unsigned> >
+                syms = linker.GetSymbols(a, Segs[s]);
+            rec.symbols.insert(rec.symbols.end(), syms.begin(), syms.end());
+        }
+        const std::vector<unsigned char>& code = linker.GetCode(a);
+        rec.linked_crc = code.empty() ? 0 : CRC32(&code[0], code.size());
+    }
+}
+
+void CompareLinkStates(const LinkState& previous, const LinkState& current,
+                       OutputUpdate& result)
+{
+    result.clear.clear();
+    result.write.clear();
+    result.moved_symbols = 0;
+
+    std::map<std::string, unsigned> oldsyms;
+    for(LinkState::objmap::const_iterator
+        i = previous.objects.begin(); i != previous.objects.end(); ++i)
+    {
+        const LinkState::ObjectRecord& rec = i->second;
+        for(unsigned b=0; b<rec.symbols.size(); ++b)
+            oldsyms.insert(rec.symbols[b]);
+
+        if(!current.Find(i->first)) CodeRange(rec, result.clear);
+    }
+
+    for(LinkState::objmap::const_iterator
+        i = current.objects.begin(); i != current.objects.end(); ++i)
+    {
+        const LinkState::ObjectRecord& rec = i->second;
+        for(unsigned b=0; b<rec.symbols.size(); ++b)
+        {
+            std::map<std::string, unsigned>::const_iterator
+                j = oldsyms.find(rec.symbols[b].first);
+            if(j != oldsyms.end() && j->second != rec.symbols[b].second)
+                ++result.moved_symbols;
+        }
+
+        const LinkState::ObjectRecord* old = previous.Find(i->first);
+        if(old
+        && old->addr[0] == rec.addr[0]
+        && old->size[0] == rec.size[0]
+        && old->linked_crc == rec.linked_crc) continue;
+
+        if(old) CodeRange(*old, result.clear);
+        CodeRange(rec, result.write);
+    }
+}
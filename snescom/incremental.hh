@@ -0,0 +1,83 @@
+#ifndef bqtIncrementalHH
+#define bqtIncrementalHH
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "o65linker.hh"
+
+/* What a previous sneslink run did. Used by --incremental
+ * to keep objects where they were and to rewrite only
+ * the parts of the output that changed.
+ *
+ * Objects are known by their file name. When one file produces
+ * several objects (IPS patches, references), they are told
+ * apart by a running number.
+ */
+class LinkState
+{
+public:
+    struct ObjectRecord
+    {
+        bool        from_o65;   /* placed by the linker, not by the input */
+        LinkageWish wish;       /* the CODE linkage it asked for */
+        unsigned    addr[4];    /* CODE, DATA, ZERO, BSS */
+        unsigned    size[4];
+        unsigned    linked_crc; /* of the CODE after linking */
+        std::vector<pair<std::string, unsigned> > symbols;
+
+        ObjectRecord();
+    };
+    typedef std::map<std::string, ObjectRecord> objmap;
+
+public:
+    LinkState();
+
+    /* Return false if the file is missing or not a state file */
+    bool Load(const std::string& filename);
+    bool Save(const std::string& filename) const;
+
+    const ObjectRecord* Find(const std::string& key) const;
+
+public:
+    int         address_type;
+    bool        fastrom;
+    std::string output_name;
+    unsigned    output_size;
+    unsigned    output_crc;
+    objmap      objects;
+};
+
+/* Names for the objects of the linker that stay the same between runs */
+const std::vector<std::string> GetObjectKeys(const O65linker& linker);
+
+/* Puts the objects that came from O65 files (from_o65[n])
+ * back where the previous run placed them, if they still fit there
+ * and still ask for the same linkage. A group is kept in place only
+ * if all of its members can be.
+ * Returns the number of objects whose CODE was kept in place.
+ */
+unsigned PinObjects(O65linker& linker, const LinkState& previous,
+                    const std::vector<std::string>& keys,
+                    const std::vector<bool>& from_o65);
+
+/* Describes the link that was just done. wishes[] are the CODE
+ * linkages as they were before the objects were placed.
+ */
+void RecordLinkState(const O65linker& linker, LinkState& state,
+                     const std::vector<std::string>& keys,
+                     const std::vector<bool>& from_o65,
+                     const std::vector<LinkageWish>& wishes);
+
+/* The CODE ranges (SNES address, size) that differ between two links */
+struct OutputUpdate
+{
+    std::vector<pair<unsigned, unsigned> > clear; /* no longer used */
+    std::vector<pair<unsigned, unsigned> > write; /* new or changed */
+    unsigned moved_symbols;
+};
+void CompareLinkStates(const LinkState& previous, const LinkState& current,
+                       OutputUpdate& result);
+
+#endif
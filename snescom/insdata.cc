@@ -34,7 +34,9 @@ const struct AddrMode AddrModes[] =
   { /* 25 pea #imm16   */   0, "#",  "",   AddrMode::tWord, AddrMode::tNone },//o #W
   { /* 26 .link group 1  */ 0, "group", "",AddrMode::tWord, AddrMode::tNone },
   { /* 27 .link page $FF */ 0, "page",  "",AddrMode::tByte, AddrMode::tNone },
-  { /* 28 .nop imm16   */   0, "",   "",   AddrMode::tWord, AddrMode::tNone }
+  { /* 28 .nop imm16   */   0, "",   "",   AddrMode::tWord, AddrMode::tNone },
+  { /* 29 .align imm24 */   0, "",   "",   AddrMode::tLong, AddrMode::tNone },
+  { /* 30 .link hot    */   0, "hot", "",  AddrMode::tNone, AddrMode::tNone }
 };
 const unsigned AddrModeCount = sizeof(AddrModes) / sizeof(AddrModes[0]);
 
@@ -45,11 +47,15 @@ const struct ins ins[] =
   { ".(",    "sb" }, // start block, no params
   { ".)",    "eb" }, // end block, no params
   { ".al",   "al" }, // A=16bit
+  { ".align",        // Alignment of the object (mode 29)
+           "--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'la" },
   { ".as",   "as" }, // A=8bit
   { ".bss",  "gb" }, // Select seG BSS
   { ".data", "gd" }, // Select seG DATA
-  { ".link",         // Select linkage (modes 26 and 27)
-           "--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'li'li" },
+  { ".link",         // Select linkage (modes 26, 27 and 30)
+           "--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'li'li'--'--'li" },
+  { ".nocross",      // Boundary the object must not cross (mode 29)
+           "--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'lc" },
   { ".nop",          // Nop macro
            "--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'--'np" },
   { ".text", "gt" }, // Select seG TEXT
@@ -1,12 +1,23 @@
 #include <cstdio>
 #include <vector>
+#include <algorithm>
 #include <string.h>
+#include <errno.h>
 using namespace std;
 
 #include "o65linker.hh"
 #include "msginsert.hh"
-#include "dataarea.hh"
+#include "romimage.hh"
 #include "space.hh"
+#include "bps.hh"
+#include "checksum.hh"
+#include "incremental.hh"
+#include "linkmap.hh"
+#include "spacereport.hh"
+#include "threadpool.hh"
+#include "hash.hh"
+#include "freescan.hh"
+#include "romaddr.hh"
 
 #include "object.hh"
 
@@ -16,7 +27,6 @@ bool already_reprocessed = true; /* required by object.cc, not really used */
 bool assembly_errors = false;
 int address_type = 3; /* Set Highrom by default */
 unsigned RomSize = 0;
-char *freespacefile;
 
 namespace
 {
@@ -25,8 +35,55 @@ namespace
         IPSformat,
         O65format,
         RAWformat,
-        SMCformat
+        SMCformat,
+        BPSformat
     } format = IPSformat;
+    
+    /* The ROM that a BPS patch is made against */
+    std::vector<unsigned char> BPSsource;
+    
+    /* For --incremental: the state file, what the previous run
+     * did, what this run did, and how the output differs.
+     */
+    std::string  IncrementalFile;
+    LinkState    PreviousLink, CurrentLink;
+    OutputUpdate IncrementalUpdate;
+    
+    /* For --map */
+    std::string MapFile;
+    
+    /* Number of threads; 0 means one per processor */
+    unsigned NumJobs = 0;
+    
+    /* For --stats */
+    bool ShowStats = false;
+    
+    /* For --pack-time-budget: seconds per organizing of a segment */
+    double PackTimeBudget = 0.2;
+    
+    /* For --base-rom and --fill-byte: the ROM whose unused
+     * areas are the free space, and the byte values that
+     * mark them unused (default: FF). Zeros are not the
+     * default, because real data has long runs of them.
+     */
+    std::vector<unsigned char> BaseROM;
+    std::vector<unsigned char> FillBytes;
+    
+    /* For --min-free-run: shorter runs of fill bytes are probably data */
+    unsigned MinFreeRun = 1024;
+    
+    /* For -m: a file of "address : size" lines */
+    std::string FreespaceFile;
+    
+    /* For --call-clusters */
+    bool CallClusters = false;
+    
+    /* For --fastrom and .link hot: whether the header says FastROM */
+    bool SpeedBit = false;
+    
+    /* For --space-report: where the JSON goes, and what it says */
+    std::string SpaceReportFile;
+    SpaceReport SpaceReports;
 
     void SetOutputFormat(const std::string& s)
     {
@@ -34,6 +91,7 @@ namespace
         else if(s == "o65") format = O65format;
         else if(s == "raw") format = RAWformat;
         else if(s == "smc") format = SMCformat;
+        else if(s == "bps") format = BPSformat;
         else
         {
             std::fprintf(stderr, "Error: Unknown output format %s'\n", s.c_str());
@@ -82,19 +140,357 @@ void MessageUndefinedSymbols(unsigned n)
     fprintf(stderr, "O65 linker: Still %u undefined symbol(s)\n", n);
 }
 
+/* Reads a number that may be given as $hex, 0xhex or decimal */
+static bool ParseNumber(const char*& s, unsigned& result)
+{
+    while(*s == ' ' || *s == '\t') ++s;
+    int base = 10;
+    if(*s == '$') { ++s; base = 16; }
+    else if(s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) { s += 2; base = 16; }
+    
+    char* end;
+    result = (unsigned)strtoul(s, &end, base);
+    if(end == s) return false;
+    s = end;
+    return true;
+}
+
+/* Adds a range of SNES addresses that may span several pages */
+static void AddFreeRange(freespacemap& freespace, unsigned addr, unsigned length)
+{
+    const unsigned sz = GetPageSize();
+    while(length > 0)
+    {
+        unsigned n = std::min(length, sz - addr % sz);
+        freespace.Add(addr / sz, addr % sz, n);
+        addr += n; length -= n;
+    }
+}
+
+/* Adds or removes a range of the ROM, which is split
+ * into the banks it is mapped into.
+ */
+static void MarkROMrange(freespacemap& freespace, unsigned offset, unsigned length, bool free)
+{
+    const int mode = (address_type == 1 || address_type == 2) ? address_type : 3;
+    const unsigned bank = mode == 3 ? 0x10000 : 0x8000;
+    while(length > 0)
+    {
+        unsigned n = std::min(length, bank - offset % bank);
+        unsigned addr = ROM2SNESaddr(offset, mode);
+        if(free)
+            freespace.Add(addr, n);
+        else
+            freespace.Del(addr, n);
+        offset += n; length -= n;
+    }
+}
+
+static bool LoadFreespaceFile(freespacemap& freespace, const std::string& filename)
+{
+    FILE* fp = fopen(filename.c_str(), "rt");
+    if(!fp)
+    {
+        std::perror(filename.c_str());
+        return false;
+    }
+    char Buf[512];
+    for(unsigned line=1; fgets(Buf, sizeof Buf, fp); ++line)
+    {
+        const char* s = Buf;
+        while(*s == ' ' || *s == '\t') ++s;
+        if(!*s || *s == '\n' || *s == '\r' || *s == '#' || *s == ';') continue;
+        
+        unsigned addr, size;
+        bool ok = ParseNumber(s, addr);
+        if(ok)
+        {
+            while(*s == ' ' || *s == '\t') ++s;
+            ok = *s++ == ':' && ParseNumber(s, size);
+        }
+        if(!ok)
+        {
+            fprintf(stderr, "%s:%u: Expected 'address : size'\n", filename.c_str(), line);
+            continue;
+        }
+        AddFreeRange(freespace, addr, size);
+    }
+    fclose(fp);
+    return true;
+}
+
+/* Finds the unused areas of the base ROM */
+static void ScanBaseROM(freespacemap& freespace)
+{
+    const int mode = (address_type == 1 || address_type == 2) ? address_type : 3;
+    
+    unsigned begin = 0, size = (unsigned)BaseROM.size();
+    if(size % 0x8000 == 0x200) begin = 0x200; // Skip the copier header
+    size -= begin;
+    
+    /* The part that can be addressed at all */
+    const unsigned maxsize = mode == 1 ? 0x3F0000 : 0x400000;
+    if(size > maxsize)
+    {
+        fprintf(stderr, "Warning: Only the first %u bytes of the base ROM can be used as free space\n",
+            maxsize);
+        size = maxsize;
+    }
+    
+    std::vector<unsigned char> fills = FillBytes;
+    if(fills.empty())
+        fills.push_back(0xFF);
+    
+    std::vector<std::pair<unsigned, unsigned> > runs;
+    for(unsigned a=0; a<fills.size(); ++a)
+        FindFillRuns(&BaseROM[begin], size, fills[a], MinFreeRun, runs);
+    
+    unsigned total = 0;
+    for(unsigned a=0; a<runs.size(); ++a)
+    {
+        MarkROMrange(freespace, runs[a].first, runs[a].second, true);
+        total += runs[a].second;
+    }
+    
+    /* The ROM header and the vectors are never free */
+    const unsigned header = mode == 3 ? 0xFFB0 : 0x7FB0;
+    if(size > header) MarkROMrange(freespace, header, 0x50, false);
+    
+    if(ShowStats)
+        fprintf(stderr, "Base ROM: %u free byte(s) in %u run(s)\n",
+            total, (unsigned)runs.size());
+}
+
 static void LoadFreespaceSpecs(freespacemap& freespace)
 {
-    // Assume everything is free space!
-    /* FIXME: Make this configurable. */
-    // add a file mapping ?
-    // something like:
-    // address : size
-    for(unsigned page=0xC0; page<=0xFF; ++page)
-        freespace.Add(page, 0x0000, GetPageSize());
+    if(BaseROM.empty() && FreespaceFile.empty())
+    {
+        // Assume everything is free space!
+        for(unsigned page=0xC0; page<=0xFF; ++page)
+            freespace.Add(page, 0x0000, GetPageSize());
+    }
+    if(!BaseROM.empty())
+        ScanBaseROM(freespace);
+    if(!FreespaceFile.empty())
+        LoadFreespaceFile(freespace, FreespaceFile);
     
     freespace.Del(0x00, 0x0000, 0x8000); // Not usable
 }
 
+/* Ranges that were placed already (e.g. kept by --incremental)
+ * must not be given to other segments sharing the same space.
+ */
+static void ReservePlaced(freespacemap& freespace, const O65linker& linker, SegmentSelection seg)
+{
+    const std::vector<unsigned> addrs = linker.GetAddrList(seg);
+    const std::vector<unsigned> sizes = linker.GetSizeList(seg);
+    const std::vector<LinkageWish> linkages = linker.GetLinkageList(seg);
+    for(unsigned a=0; a<linkages.size(); ++a)
+        if(linkages[a].type == LinkageWish::LinkHere && sizes[a] > 0)
+            freespace.Del(addrs[a], sizes[a]);
+}
+
+/* Organizes the segment, recording the space around it for --space-report */
+static void Organize(freespacemap& freespace, O65linker& linker, SegmentSelection seg)
+{
+    if(!SpaceReportFile.empty())
+        SpaceReports.Record("before", seg, freespace, linker);
+    freespace.OrganizeO65linker(linker, seg);
+    if(!SpaceReportFile.empty())
+        SpaceReports.Record("after", seg, freespace, linker);
+}
+
+/* How many of the long calls between objects ended up within a bank */
+static void ReportNearCalls(const std::vector<CallEdge>& graph, const O65linker& linker)
+{
+    const std::vector<unsigned> addrs = linker.GetAddrList(CODE);
+    unsigned calls = 0, near = 0;
+    for(unsigned a=0; a<graph.size(); ++a)
+    {
+        const CallEdge& edge = graph[a];
+        calls += edge.calls;
+        if(addrs[edge.from] / GetPageSize() == addrs[edge.to] / GetPageSize())
+            near += edge.calls;
+    }
+    fprintf(stderr, "O65 linker: %u of %u long call(s) between objects stay within a bank,"
+                    " and could be JSR\n", near, calls);
+}
+
+/* Moves the code into the FastROM mirrors: all of it with --fastrom,
+ * otherwise only the hot objects. Returns true if the header should
+ * say FastROM: with --fastrom, or when a hot object is in a fast bank.
+ */
+static bool MirrorFastROM(O65linker& linker)
+{
+    std::vector<unsigned> addrs = linker.GetAddrList(CODE);
+    const std::vector<unsigned> sizes = linker.GetSizeList(CODE);
+    const std::vector<LinkageWish> linkages = linker.GetLinkageList(CODE);
+    
+    bool any = IsFastROM();
+    unsigned moved = 0;
+    for(unsigned a=0; a<addrs.size(); ++a)
+    {
+        if(!IsFastROM() && !linkages[a].hot) continue;
+        if(!sizes[a]) continue;
+        
+        unsigned addr = FastROMaddr(addrs[a]);
+        if(addr != addrs[a])
+        {
+            addrs[a] = addr;
+            ++moved;
+        }
+        if(addr >= 0x800000)
+            any = true;
+        else if(linkages[a].hot)
+            fprintf(stderr, "O65 linker: Hot object %u at $%06X has no FastROM mirror\n", a+1, addr);
+    }
+    if(moved)
+    {
+        linker.PutAddrList(addrs, CODE);
+        fprintf(stderr, "O65 linker: %u object(s) moved to the FastROM mirror\n", moved);
+    }
+    return any;
+}
+
+namespace
+{
+    /* An input file, read before anything is added to the linker */
+    struct InputFile
+    {
+        std::string name;
+        LinkInput   input;
+        std::string messages; // shown when the file is added
+        bool        is_o65;   // for --incremental
+        
+        InputFile(): name(), input(), messages(), is_o65(false) { }
+    };
+    
+    void AddMessage(InputFile& file, const char* fmt, unsigned param)
+    {
+        char Buf[128];
+        std::sprintf(Buf, fmt, param);
+        file.messages += file.name + Buf;
+    }
+    
+    LinkageWish DecodeLinkage(InputFile& file, const O65& object)
+    {
+        const vector<pair<unsigned char, string> >&
+            customheaders = object.GetCustomHeaders();
+        
+        LinkageWish Linkage;
+        
+        for(unsigned b=0; b<customheaders.size(); ++b)
+        {
+            unsigned char type = customheaders[b].first;
+            const string& data = customheaders[b].second;
+            switch(type)
+            {
+                case 10: // linkage type
+                {
+                    unsigned param = 0;
+                    if(data.size() >= 5)
+                    {
+                        param = (data[1] & 0xFF) 
+                              | ((data[2] & 0xFF) << 8)
+                              | ((data[3] & 0xFF) << 16)
+                              | ((data[4] & 0xFF) << 24);
+                    }
+                    switch(data[0])
+                    {
+                        case 0:
+                            Linkage = LinkageWish();
+                            break;
+                        case 1:
+                            Linkage.SetLinkageGroup(param);
+                            AddMessage(file, " will be linked in group %u\n", param);
+                            break;
+                        case 2:
+                            Linkage.SetLinkagePage(param);
+                            AddMessage(file, " will be linked to page $%02X\n", param);
+                            break;
+                        case 3:
+                        case 4:
+                            /* The same check as the assembler's */
+                            if(param == 0 || (param & (param-1)) || param > 0x10000)
+                            {
+                                AddMessage(file,
+                                    data[0] == 3
+                                        ? ": Ignoring .align $%X, not a power of 2 up to $10000\n"
+                                        : ": Ignoring .nocross $%X, not a power of 2 up to $10000\n",
+                                    param);
+                            }
+                            else if(data[0] == 3)
+                            {
+                                Linkage.SetAlignment(param);
+                                AddMessage(file, " will be aligned to $%X\n", param);
+                            }
+                            else
+                            {
+                                Linkage.SetNoCross(param);
+                                AddMessage(file, " will not cross a $%X boundary\n", param);
+                            }
+                            break;
+                        case 5:
+                            Linkage.SetHot();
+                            file.messages += file.name + " is hot, and will be called through FastROM\n";
+                            break;
+                    }
+                    break;
+                }
+                case 0: // filename
+                case 1: // operating system header
+                case 2: // assembler name
+                case 3: // author
+                case 4: // creation date
+                    break;
+            }
+        }
+        return Linkage;
+    }
+    
+    void ReadInputFile(InputFile& file)
+    {
+        char Buf[5];
+        FILE *fp = fopen(file.name.c_str(), "rb");
+        if(!fp)
+        {
+            file.messages = file.name + ": " + strerror(errno) + "\n";
+            return;
+        }
+        
+        fread(Buf, 1, 5, fp);
+        if(!strncmp(Buf, "PATCH", 5))
+        {
+            O65linker::ParseIPSfile(fp, file.name, file.input);
+        }
+        else
+        {
+            file.input.items.push_back(LinkInput::Item());
+            
+            LinkInput::Item& item = file.input.items.back();
+            if(!item.object.Load(fp, file.messages))
+            {
+                file.messages += file.name + ": Skipping invalid object file\n";
+                file.input.items.clear();
+                fclose(fp);
+                return;
+            }
+            item.name    = file.name;
+            item.linkage = DecodeLinkage(file, item.object);
+            file.is_o65  = true;
+        }
+        fclose(fp);
+    }
+    
+    struct InputReader
+    {
+        std::vector<InputFile>& files;
+        
+        InputReader(std::vector<InputFile>& f): files(f) { }
+        void operator() (unsigned n) { ReadInputFile(files[n]); }
+    };
+}
+
 static unsigned Calc2pow(unsigned ROMsize)
 {
     unsigned result = 0;
@@ -102,69 +498,244 @@ static unsigned Calc2pow(unsigned ROMsize)
     return result;
 }
 
-static void WriteCheckSumPair(std::FILE* stream, unsigned HeaderBegin, unsigned sum1)
+static void WriteCheckSumPair(ROMimage& ROMdata, unsigned HeaderBegin, unsigned sum1)
 {
     sum1 &= 0xFFFF;
     unsigned sum2 = sum1 ^ 0xFFFF;
 
-    fseek(stream, HeaderBegin + 0xDC, SEEK_SET);
-    fputc(sum2 & 0xFF, stream);
-    fputc(sum2 >> 8, stream);
-    fputc(sum1 & 0xFF, stream);
-    fputc(sum1 >> 8, stream);
+    ROMdata[HeaderBegin + 0xDC] = sum2 & 0xFF;
+    ROMdata[HeaderBegin + 0xDD] = (unsigned char)(sum2 >> 8);
+    ROMdata[HeaderBegin + 0xDE] = sum1 & 0xFF;
+    ROMdata[HeaderBegin + 0xDF] = (unsigned char)(sum1 >> 8);
 }
 
-static void MapSNESintoROM(DataArea& area, const Object& obj)
+/* A part of the segment that goes into one ROM page */
+struct ROMchunk
+{
+    unsigned snes_addr;
+    unsigned rom_addr;
+    unsigned size;
+};
+typedef std::vector<ROMchunk> ROMplan;
+
+/* With an object given, the pages where it has nothing are skipped,
+ * so that code in the FastROM mirror does not drag in all the
+ * banks between $00 and $80.
+ */
+static void PlanSNESrange(ROMplan& result, unsigned base, unsigned size, bool verbose,
+                          const Object* obj = NULL)
 {
-    unsigned base = obj.GetSegmentBase();
-    unsigned size = obj.GetSegmentSize();
-    
-    //fprintf(stderr, "base=%u, size=%u\n", base,size);
-    
     while(size > 0)
     {
         unsigned base_begin = base - (base % GetPageSize());
         unsigned base_end   = base_begin + GetPageSize();
         
-        unsigned write_to    = SNES2ROMaddr(base);
+        /* Below $C00000, the halves of a bank go to different places */
+        if(!IsSNESbased(base) && (base & 0xFFFF) < 0x8000)
+            base_end = base_begin + 0x8000;
+        
         unsigned write_count = size;
         if(base + write_count > base_end) write_count = base_end - base;
+        
+        if(obj && !obj->GetUtilization(base, write_count))
+        {
+            base += write_count;
+            size -= write_count;
+            continue;
+        }
+        
+        unsigned write_to = SNES2ROMaddr(base);
 
-        fprintf(stderr, "  base=$%X, size=$%X, write_to=$%X, write_count=$%X\n",
-            base, size, write_to, write_count);
+        if(verbose)
+            fprintf(stderr, "  base=$%X, size=$%X, write_to=$%X, write_count=$%X\n",
+                base, size, write_to, write_count);
         
-        area.WriteLump(write_to,
-           obj.GetContent(base, write_count));
+        ROMchunk chunk = { base, write_to, write_count };
+        result.push_back(chunk);
         
         base += write_count;
         size -= write_count;
     }
 }
 
+static const ROMplan PlanSNESintoROM(const Object& obj)
+{
+    ROMplan result;
+    
+    unsigned base = obj.GetSegmentBase();
+    unsigned size = obj.GetSegmentSize();
+    
+    //fprintf(stderr, "base=%u, size=%u\n", base,size);
+    
+    PlanSNESrange(result, base, size, true, &obj);
+    return result;
+}
+
+static unsigned GetROMtop(const ROMplan& plan)
+{
+    unsigned top = 0;
+    for(unsigned a=0; a<plan.size(); ++a)
+        if(plan[a].rom_addr + plan[a].size > top)
+            top = plan[a].rom_addr + plan[a].size;
+    return top;
+}
+
+/* Calls func(snes_addr, count, rom_offset) for each part of
+ * the segment that falls in the given ROM range.
+ */
+template<typename Func>
+static void ForEachROMpart(const ROMplan& plan, unsigned begin, unsigned size, Func& func)
+{
+    for(unsigned a=0; a<plan.size(); ++a)
+    {
+        const ROMchunk& c = plan[a];
+        unsigned lo = c.rom_addr > begin ? c.rom_addr : begin;
+        unsigned hi = c.rom_addr + c.size;
+        if(hi > begin + size) hi = begin + size;
+        if(lo >= hi) continue;
+        func(c.snes_addr + (lo - c.rom_addr), hi - lo, lo - begin);
+    }
+}
+
+namespace
+{
+    struct ROMcopier
+    {
+        const Object& obj; unsigned char* target;
+        void operator() (unsigned snes_addr, unsigned count, unsigned offset)
+        {
+            obj.CopyContent(snes_addr, count, target + offset);
+        }
+    };
+    struct ROMutilization
+    {
+        const Object& obj; unsigned result;
+        void operator() (unsigned snes_addr, unsigned count, unsigned)
+        {
+            result += obj.GetUtilization(snes_addr, count);
+        }
+    };
+}
+
+/* Copies the bytes of the ROM range that the segment defines */
+static void CopyROMrange(const ROMplan& plan, const Object& obj,
+                         unsigned begin, unsigned size, unsigned char* target)
+{
+    ROMcopier copier = { obj, target };
+    ForEachROMpart(plan, begin, size, copier);
+}
+
+/* Returns the number of bytes the segment defines in the ROM range */
+static unsigned GetROMutilization(const ROMplan& plan, const Object& obj,
+                                  unsigned begin, unsigned size)
+{
+    ROMutilization counter = { obj, 0 };
+    ForEachROMpart(plan, begin, size, counter);
+    return counter.result;
+}
+
+/* If the file still holds what the previous incremental run wrote,
+ * rewrites only the parts that changed and returns true.
+ */
+/* How much of the chunk is within the image */
+static unsigned ChunkSizeInImage(const ROMimage& ROMdata, const ROMchunk& c)
+{
+    if(c.rom_addr >= ROMdata.GetSize()) return 0;
+    unsigned n = c.size;
+    if(n > ROMdata.GetSize() - c.rom_addr) n = ROMdata.GetSize() - c.rom_addr;
+    return n;
+}
+
+static bool UpdateROMimage(ROMimage& ROMdata, const ROMplan& plan, const Object& obj)
+{
+    if(IncrementalFile.empty()
+    || PreviousLink.output_size != ROMdata.GetSize()
+    || PreviousLink.output_name != CurrentLink.output_name
+    || PreviousLink.output_crc  != CRC32(ROMdata.GetData(), ROMdata.GetSize()))
+    {
+        return false;
+    }
+    
+    ROMplan clear, write;
+    for(unsigned a=0; a<IncrementalUpdate.clear.size(); ++a)
+        PlanSNESrange(clear, IncrementalUpdate.clear[a].first,
+                             IncrementalUpdate.clear[a].second, false);
+    for(unsigned a=0; a<IncrementalUpdate.write.size(); ++a)
+        PlanSNESrange(write, IncrementalUpdate.write[a].first,
+                             IncrementalUpdate.write[a].second, false);
+    
+    unsigned written = 0;
+    for(unsigned a=0; a<clear.size(); ++a)
+    {
+        const ROMchunk& c = clear[a];
+        unsigned n = ChunkSizeInImage(ROMdata, c);
+        memset(ROMdata.GetData() + c.rom_addr, 0, n);
+    }
+    for(unsigned a=0; a<write.size(); ++a)
+    {
+        const ROMchunk& c = write[a];
+        unsigned n = ChunkSizeInImage(ROMdata, c);
+        memset(ROMdata.GetData() + c.rom_addr, 0, n);
+        CopyROMrange(plan, obj, c.rom_addr, n, ROMdata.GetData() + c.rom_addr);
+        written += n;
+    }
+    
+    fprintf(stderr, "O65 linker: Incremental: rewrote %u byte(s) in %u range(s), %u symbol(s) moved\n",
+        written, (unsigned)write.size(), IncrementalUpdate.moved_symbols);
+    return true;
+}
+
 static void FixupSMC(const Object& obj, std::FILE* stream)
 {
-    DataArea rom_obj;
-    MapSNESintoROM(rom_obj, obj);
+    const ROMplan plan = PlanSNESintoROM(obj);
 
-Do_Over:
-    unsigned filesize = rom_obj.GetTop();
+    unsigned filesize = GetROMtop(plan);
     if(filesize < RomSize) filesize = RomSize;
-    std::vector<unsigned char> ROMdata = rom_obj.GetContent(0, filesize);
-    
-    fseek(stream, 0, SEEK_SET);
-    fwrite(&ROMdata[0], 1, ROMdata.size(), stream);
     
-    unsigned RomSize2pow = Calc2pow(filesize);
-    if(RomSize2pow < 10) RomSize2pow = 10;
-    unsigned RomSizeSmallPow = RomSize2pow - 10;
-    unsigned CalculatedSize = 1 << RomSize2pow;
+    /* The header is searched for at $7Fxx and $FFxx,
+     * so look at at least 64k even if the ROM is smaller.
+     */
+    std::vector<unsigned char> HeaderWindow(0x10000);
+    CopyROMrange(plan, obj, 0, (unsigned)HeaderWindow.size(), &HeaderWindow[0]);
     
-    unsigned Pow2SizeDown = filesize;
-    if(CalculatedSize > Pow2SizeDown) Pow2SizeDown = 1 << (RomSize2pow-1);
+    /* Everything is decided before anything is written,
+     * so the file is written exactly once.
+     */
+    unsigned RomSize2pow, RomSizeSmallPow, CalculatedSize, Pow2SizeDown;
+    unsigned HeaderBegin, sizebyte;
+    bool SizeByteGiven;
+    for(;;)
+    {
+        RomSize2pow = Calc2pow(filesize);
+        if(RomSize2pow < 10) RomSize2pow = 10;
+        RomSizeSmallPow = RomSize2pow - 10;
+        CalculatedSize = 1 << RomSize2pow;
+        
+        Pow2SizeDown = filesize;
+        if(CalculatedSize > Pow2SizeDown) Pow2SizeDown = 1 << (RomSize2pow-1);
+        
+        unsigned HeaderOffs = GuessROMheaderOffset(&HeaderWindow[0], CalculatedSize);
+        HeaderBegin = HeaderOffs & 0xFFFF00;
+        
+        sizebyte = HeaderWindow[HeaderBegin + 0xD7];
+        SizeByteGiven = GetROMutilization(plan, obj, HeaderBegin + 0xD7, 1) != 0;
+        if(!SizeByteGiven || sizebyte == RomSizeSmallPow)
+            break;
+        
+        unsigned wanted_size = 1 << (10 + sizebyte);
+        fprintf(stderr, "O65 linker: Your code tells that the ROM should be %u bytes in size. It is %u bytes.\n",
+            wanted_size,
+            filesize);
+        if(wanted_size <= filesize)
+        {
+            fprintf(stderr, "            Fixing this by changing the size byte.\n");
+            break;
+        }
+        fprintf(stderr, "            Fixing this by extending the ROM size.\n");
+        RomSize = filesize = wanted_size;
+    }
     
-    unsigned HeaderOffs = GuessROMheaderOffset(&ROMdata[0], CalculatedSize);
-    unsigned HeaderBegin = HeaderOffs & 0xFFFF00;
-    unsigned HeaderUsage = rom_obj.GetUtilization(HeaderBegin + 0xB0, 0x50);
+    unsigned HeaderUsage = GetROMutilization(plan, obj, HeaderBegin + 0xB0, 0x50);
     unsigned MinimumUtilization =
         3*2 // 3 vectors
        +3   // misc vars
@@ -180,83 +751,131 @@ Do_Over:
             HeaderBegin+0xB0, HeaderUsage);
     }
     
-    unsigned sizebyte = ROMdata[HeaderBegin + 0xD7];
-    if(rom_obj.GetUtilization(HeaderBegin + 0xD7, 1) == 0)
+    if(!SizeByteGiven)
     {
-        fseek(stream, HeaderBegin+0xD7, SEEK_SET);
-        fputc(RomSizeSmallPow, stream);
-        sizebyte = RomSizeSmallPow;
-        
         fprintf(stderr, "O65 linker: Patching in the ROM size as %u kB (%u bytes, from %u)\n",
             1 << RomSizeSmallPow,
             1 << RomSize2pow,
             filesize);
     }
-    else if(sizebyte != RomSizeSmallPow)
+    bool PatchSizeByte = sizebyte != RomSizeSmallPow || !SizeByteGiven;
+    if(PatchSizeByte) sizebyte = RomSizeSmallPow;
+    
+    /* The output file is written in place. A tiny ROM still gets the header bytes. */
+    ROMimage ROMdata(stream);
+    ROMdata.SetSize(filesize > HeaderBegin + 0xE0 ? filesize : HeaderBegin + 0xE0);
+    if(!UpdateROMimage(ROMdata, plan, obj))
     {
-        unsigned wanted_size = 1 << (10 + sizebyte);
-        fprintf(stderr, "O65 linker: Your code tells that the ROM should be %u bytes in size. It is %u bytes.\n",
-            wanted_size,
-            filesize);
-        if(wanted_size > filesize)
-        {
-            fprintf(stderr, "            Fixing this by extending the ROM size.\n");
-            RomSize = wanted_size;
-            ftruncate(fileno(stream), wanted_size);
-            goto Do_Over;
-        }
-        else
-        {
-            fprintf(stderr, "            Fixing this by changing the size byte.\n");
-            fseek(stream, HeaderBegin+0xD7, SEEK_SET);
-            fputc(RomSizeSmallPow, stream);
-            sizebyte = RomSizeSmallPow;
-        }
+        if(!IncrementalFile.empty())
+            memset(ROMdata.GetData(), 0, ROMdata.GetSize());
+        CopyROMrange(plan, obj, 0, filesize, ROMdata.GetData());
     }
     
-    unsigned sum1 = sizebyte + 0x00 + 0x00 + 0xFF + 0xFF;
-    
-    for(unsigned a=0; a<Pow2SizeDown; ++a)
+    /* The map mode byte tells that the code wants 3.58 MHz ROM */
+    if(SpeedBit && !(ROMdata[HeaderBegin + 0xD5] & 0x10))
     {
-        /* Ignore the checksum region in checksum calculation,
-         * because it might be incorrect.
-         * Ignore also the sizebyte, because we changed it.
-         */
-        if(a >= HeaderBegin + 0xDC
-        && a <  HeaderBegin + 0xE0) continue;
-        if(a == HeaderBegin + 0xD7) continue;
-        
-        sum1 += ROMdata[a];
+        fprintf(stderr, "O65 linker: Setting the FastROM bit in the header\n");
+        ROMdata[HeaderBegin + 0xD5] |= 0x10;
     }
-    if(Pow2SizeDown < CalculatedSize)
+    
+    /* Ignore the checksum region in checksum calculation,
+     * because it might be incorrect.
+     * Ignore also the sizebyte, because we may change it.
+     */
+    unsigned sum1 = sizebyte + 0x00 + 0x00 + 0xFF + 0xFF;
+    
+    unsigned SumSize = Pow2SizeDown < filesize ? Pow2SizeDown : filesize;
+    sum1 += (unsigned)ByteSum(ROMdata.GetData(), SumSize);
+    for(unsigned a = HeaderBegin + 0xD7; a < HeaderBegin + 0xE0; ++a)
+        if(a < SumSize && (a == HeaderBegin + 0xD7 || a >= HeaderBegin + 0xDC))
+            sum1 -= ROMdata[a];
+    
+    /* The part beyond the largest power of two is
+     * mirrored until the ROM size is a power of two.
+     */
+    if(Pow2SizeDown < filesize)
     {
-        unsigned Remainder = CalculatedSize - Pow2SizeDown;
+        unsigned Remainder = filesize - Pow2SizeDown;
         unsigned MirrorCount = Pow2SizeDown / Remainder;
-        unsigned sum2 = 0;
-        for(unsigned a=0; a<Remainder; ++a) sum2 += ROMdata[Pow2SizeDown + a];
+        unsigned sum2 = (unsigned)ByteSum(ROMdata.GetData() + Pow2SizeDown, Remainder);
         sum1 += sum2 * MirrorCount;
     }
     
     fprintf(stderr, "O65 linker: Writing checksum (do=%u,cc=%u, sum1=$%04X, sum2=$%04X)\n",
         Pow2SizeDown,CalculatedSize, sum1&0xFFFF, (sum1^0xFFFF)&0xFFFF);
-    WriteCheckSumPair(stream, HeaderBegin, sum1);
+    
+    if(PatchSizeByte) ROMdata[HeaderBegin + 0xD7] = (unsigned char)sizebyte;
+    WriteCheckSumPair(ROMdata, HeaderBegin, sum1);
+    
+    if(!IncrementalFile.empty())
+    {
+        CurrentLink.output_size = ROMdata.GetSize();
+        CurrentLink.output_crc  = CRC32(ROMdata.GetData(), ROMdata.GetSize());
+    }
+    ROMdata.Close();
+}
+
+static void WriteBPSpatch(const Object& obj, std::FILE* stream)
+{
+    const ROMplan plan = PlanSNESintoROM(obj);
+    
+    std::vector<unsigned char> target = BPSsource;
+    
+    unsigned top = GetROMtop(plan);
+    if(top < RomSize) top = RomSize;
+    if(target.size() < top) target.resize(top);
+    
+    if(top) CopyROMrange(plan, obj, 0, top, &target[0]);
+    
+    WriteBPS(stream, BPSsource, target);
 }
 
-static void Import(O65linker& linker, Object& obj, SegmentSelection seg)
+/* Copies the objects in address order, releasing each
+ * one when it is done, so that the linker memory goes away
+ * as fast as the output grows.
+ */
+static void Import(O65linker& linker, Object& obj)
 {
-    std::vector<unsigned> o65addrs = linker.GetAddrList(seg);
-    for(unsigned a=0; a<o65addrs.size(); ++a)
+    static const SegmentSelection segs[4] = { CODE, DATA, ZERO, BSS };
+    std::vector<unsigned> o65addrs[4];
+    for(unsigned s=0; s<4; ++s)
+        o65addrs[s] = linker.GetAddrList(segs[s]);
+    
+    std::vector<std::pair<unsigned, unsigned> > order; // address, objno
+    order.reserve(linker.GetObjectCount());
+    for(unsigned a=0; a<linker.GetObjectCount(); ++a)
+        order.push_back(std::make_pair(o65addrs[0][a], a));
+    std::sort(order.begin(), order.end());
+    
+    for(unsigned n=0; n<order.size(); ++n)
     {
-        const vector<unsigned char>& code = linker.GetSeg(seg, a);
-        if(code.empty()) continue;
-         
-        char Buf[64];
-        sprintf(Buf, "object_%u_%s", a+1, GetSegmentName(seg).c_str());
-        
-        obj.DefineLabel(Buf, o65addrs[a]);
-        
-        obj.SetPos(o65addrs[a]);
-        obj.AddLump(code);
+        unsigned a = order[n].second;
+        for(unsigned s=0; s<4; ++s)
+        {
+            const vector<unsigned char>& code = linker.GetSeg(segs[s], a);
+            if(code.empty()) continue;
+            
+            char Buf[64];
+            sprintf(Buf, "object_%u_%s", a+1, GetSegmentName(segs[s]).c_str());
+            
+            obj.SelectSegment(segs[s]);
+            obj.DefineLabel(Buf, o65addrs[s][a]);
+            
+            obj.SetPos(o65addrs[s][a]);
+            obj.AddLump(code);
+        }
+        linker.Release(a);
+    }
+}
+
+/* Patches from resolved references go over the code */
+static void ImportPatches(O65linker& linker, Object& obj)
+{
+    const std::vector<LinkPatch>& patches = linker.GetPatches();
+    for(unsigned a=0; a<patches.size(); ++a)
+    {
+        obj.SetPos(patches[a].address);
+        obj.AddLump(patches[a].bytes);
     }
 }
 
@@ -265,11 +884,8 @@ static void WriteOut(O65linker& linker, std::FILE* stream)
     Object obj;
     
     obj.StartScope();
-     obj.SelectTEXT(); Import(linker, obj, CODE);
-     obj.SelectDATA(); Import(linker, obj, DATA);
-     obj.SelectZERO(); Import(linker, obj, ZERO);
-     obj.SelectBSS(); Import(linker, obj, BSS);
-     obj.SelectTEXT();
+     Import(linker, obj);
+     obj.SelectTEXT(); ImportPatches(linker, obj);
     obj.EndScope();
     
     switch(format)   
@@ -284,10 +900,13 @@ static void WriteOut(O65linker& linker, std::FILE* stream)
             obj.WriteRAW(stream);
             break;
         case SMCformat:
-            obj.WriteRAW(stream, RomSize, 0);
             obj.SelectTEXT();
             FixupSMC(obj, stream);
             break;
+        case BPSformat:
+            obj.SelectTEXT();
+            WriteBPSpatch(obj, stream);
+            break;
     }
     obj.Dump();
 }
@@ -310,10 +929,22 @@ int main(int argc, char** argv)
             {"outformat", 0,0,'f'},
             {"romsize",  0,0,'s'},
             {"romtype", 0,0,'t'},
-            {"freespacemap",0,0,'m'},
+            {"freespacemap",1,0,'m'},
+            {"bps-source",1,0,501},
+            {"incremental",1,0,502},
+            {"map",      1,0,503},
+            {"jobs",     1,0,'j'},
+            {"stats",    0,0,504},
+            {"pack-time-budget",1,0,505},
+            {"base-rom", 1,0,506},
+            {"fill-byte",1,0,507},
+            {"call-clusters",0,0,508},
+            {"fastrom",  0,0,509},
+            {"space-report",1,0,510},
+            {"min-free-run",1,0,511},
             {0,0,0,0}
         };
-        int c = getopt_long(argc,argv, "hVo:f:s:t:m:", long_options, &option_index);
+        int c = getopt_long(argc,argv, "hVo:f:s:t:m:j:", long_options, &option_index);
         if(c==-1) break;
         switch(c)
         {
@@ -339,9 +970,35 @@ int main(int argc, char** argv)
                     "\nOptions:\n"
                     " --help, -h            This help\n"
                     " --version, -V         Displays version information\n"
-                    " -f, --outformat <fmt> Select output format: ips,raw,o65,smc (default: ips)\n"
+                    " -f, --outformat <fmt> Select output format: ips,raw,o65,smc,bps (default: ips)\n"
                     " -o <file>             Places the output into <file>\n"
                     " -s <size>             Desired size of the ROM (must be a power of 2, and >= 1024)\n"
+                    " --bps-source <file>   The ROM that a BPS patch applies to (default: none)\n"
+                    " --incremental <file>  Keep the placements of the previous run in <file>,\n"
+                    "                       and only rewrite what changed in a SMC file\n"
+                    " --map <file>          Write a link map into <file>, and a binary\n"
+                    "                       symbol index into <file>.idx\n"
+                    " -j, --jobs <n>        Use <n> threads (default: one per processor)\n"
+                    " --stats               Show statistics about the link\n"
+                    " --pack-time-budget <ms>\n"
+                    "                       When objects do not fit in the free space, search\n"
+                    "                       for a better placement for up to this long in\n"
+                    "                       all when organizing a segment (default: 200)\n"
+                    " --base-rom <file>     Use the unused areas of <file> as the free space\n"
+                    " --fill-byte <n>       The value of unused bytes in the base ROM; may be\n"
+                    "                       given many times (default: 0xFF)\n"
+                    " --min-free-run <n>    Only runs of at least <n> unused bytes in the base\n"
+                    "                       ROM are free space; shorter ones are taken to be\n"
+                    "                       data (default: 1024)\n"
+                    " -m, --freespacemap <file>\n"
+                    "                       Add the free space listed in <file>, one\n"
+                    "                       'address : size' per line\n"
+                    " --call-clusters       Put objects that call each other in the same bank\n"
+                    " --fastrom             Address all ROM code through the $80-$FF banks,\n"
+                    "                       and set the FastROM bit in the SMC header\n"
+                    " --space-report <file> Show how full each bank is before and after\n"
+                    "                       placing each segment, and write it as JSON\n"
+                    "                       into <file>\n"
                     "\nNo warranty whatsoever.\n",
                     argv[0]);
                 return 0;
@@ -350,19 +1007,6 @@ int main(int argc, char** argv)
             case 'o':
             {
                 outfn = optarg;
-                if(outfn != "-")
-                {
-                    if(output)
-                    {
-                        std::fclose(output);
-                    }
-                    output = std::fopen(outfn.c_str(), "wb");
-                    if(!output)
-                    {
-                        std::perror(outfn.c_str());
-                        goto ErrorExit;
-                    }
-                }
                 break;
             }
             case 'f':
@@ -390,9 +1034,46 @@ int main(int argc, char** argv)
             case 't':
                 address_type = atoi(optarg);
                 break;
+            case 501: // bps-source
+                if(!LoadBinaryFile(optarg, BPSsource))
+                    goto ErrorExit;
+                break;
+            case 502: // incremental
+                IncrementalFile = optarg;
+                break;
+            case 503: // map
+                MapFile = optarg;
+                break;
+            case 'j':
+                NumJobs = (unsigned)strtol(optarg, 0, 10);
+                break;
+            case 504: // stats
+                ShowStats = true;
+                break;
+            case 505: // pack-time-budget
+                PackTimeBudget = (double)strtol(optarg, 0, 10) / 1000.0;
+                break;
+            case 506: // base-rom
+                if(!LoadBinaryFile(optarg, BaseROM))
+                    goto ErrorExit;
+                break;
+            case 507: // fill-byte
+                FillBytes.push_back((unsigned char)strtol(optarg, 0, 0));
+                break;
+            case 508: // call-clusters
+                CallClusters = true;
+                break;
+            case 509: // fastrom
+                SetFastROM(true);
+                break;
+            case 510: // space-report
+                SpaceReportFile = optarg;
+                break;
+            case 511: // min-free-run
+                MinFreeRun = (unsigned)strtol(optarg, 0, 0);
+                break;
             case 'm':
-                freespacefile = new char[strlen(optarg)];
-                strcpy(freespacefile, optarg);
+                FreespaceFile = optarg;
                 break;
         }
     }
@@ -412,93 +1093,95 @@ int main(int argc, char** argv)
         return -1;
     }
     
+    if(!outfn.empty() && outfn != "-")
+    {
+        /* An incremental SMC build updates the previous file in place */
+        if(!IncrementalFile.empty() && format == SMCformat)
+            output = std::fopen(outfn.c_str(), "r+b");
+        if(!output)
+            output = std::fopen(outfn.c_str(), "w+b");
+        if(!output)
+        {
+            std::perror(outfn.c_str());
+            return -1;
+        }
+    }
+    
+    ThreadPool pool(NumJobs ? NumJobs : ThreadPool::GetCPUcount());
     
     O65linker linker;
     
+    /* For each object, whether it came from an O65 file */
+    std::vector<bool> from_o65;
+    
+    /* Read all files first, then add them in command line order */
+    std::vector<InputFile> inputs(files.size());
     for(unsigned a=0; a<files.size(); ++a)
+        inputs[a].name = files[a];
+    
+    InputReader reader(inputs);
+    pool.RunEach(reader, (unsigned)inputs.size());
+    
+    for(unsigned a=0; a<inputs.size(); ++a)
     {
-        char Buf[5];
-        FILE *fp = fopen(files[a].c_str(), "rb");
-        if(!fp)
-        {
-            perror(files[a].c_str());
-            continue;
-        }
+        InputFile& file = inputs[a];
+        fprintf(stderr, "%s", file.messages.c_str());
         
-        fread(Buf, 1, 5, fp);
-        if(!strncmp(Buf, "PATCH", 5))
+        unsigned count = linker.GetObjectCount();
+        linker.AddInput(file.input);
+        
+        if(file.is_o65 && linker.GetObjectCount() > count)
         {
-            linker.LoadIPSfile(fp, files[a]);
+            from_o65.resize(linker.GetObjectCount());
+            from_o65.back() = true;
         }
-        else
+        /* Free the memory early */
+        file.input.items.clear();
+    }
+    
+    std::vector<LinkageWish> wishes = linker.GetLinkageList(CODE);
+    if(!IncrementalFile.empty())
+    {
+        from_o65.resize(linker.GetObjectCount());
+        if(PreviousLink.Load(IncrementalFile)
+        && PreviousLink.address_type == address_type
+        && PreviousLink.fastrom == IsFastROM())
         {
-            O65 tmp;
-            tmp.Load(fp);
-            
-            const vector<pair<unsigned char, string> >&
-                customheaders = tmp.GetCustomHeaders();
-            
-            LinkageWish Linkage;
-            
-            for(unsigned b=0; b<customheaders.size(); ++b)
-            {
-                unsigned char type = customheaders[b].first;
-                const string& data = customheaders[b].second;
-                switch(type)
-                {
-                    case 10: // linkage type
-                    {
-                        unsigned param = 0;
-                        if(data.size() >= 5)
-                        {
-                            param = (data[1] & 0xFF) 
-                                  | ((data[2] & 0xFF) << 8)
-                                  | ((data[3] & 0xFF) << 16)
-                                  | ((data[4] & 0xFF) << 24);
-                        }
-                        switch(data[0])
-                        {
-                            case 0:
-                                Linkage = LinkageWish();
-                                break;
-                            case 1:
-                                Linkage.SetLinkageGroup(param);
-                                fprintf(stderr, "%s will be linked in group %u\n",
-                                    files[a].c_str(), param);
-                                break;
-                            case 2:
-                                Linkage.SetLinkagePage(param);
-                                fprintf(stderr, "%s will be linked to page $%02X\n",
-                                    files[a].c_str(), param);
-                                break;
-                        }
-                        break;
-                    }
-                    case 0: // filename
-                    case 1: // operating system header
-                    case 2: // assembler name
-                    case 3: // author
-                    case 4: // creation date
-                        break;
-                }
-            }
-            
-            linker.AddObject(tmp, files[a], Linkage);
+            unsigned pinned = PinObjects(linker, PreviousLink, GetObjectKeys(linker), from_o65);
+            fprintf(stderr, "O65 linker: Incremental: %u of %u object(s) kept in place\n",
+                pinned, linker.GetObjectCount());
         }
-        fclose(fp);
+        else
+            PreviousLink = LinkState();
     }
     
     freespacemap freespace_code;
+    freespace_code.SetPackTimeBudget(PackTimeBudget);
+    freespace_code.SetThreadPool(&pool);
     LoadFreespaceSpecs(freespace_code);
+    
+    std::vector<CallEdge> callgraph;
+    if(CallClusters || ShowStats)
+        callgraph = linker.GetCallGraph();
+    if(CallClusters)
+        freespace_code.SetCallGraph(&callgraph);
+    
     /* Organize the code blobs */    
-    freespace_code.OrganizeO65linker(linker, CODE);
+    Organize(freespace_code, linker, CODE);
+    if(CallClusters || ShowStats)
+        ReportNearCalls(callgraph, linker);
+    SpeedBit = MirrorFastROM(linker);
     
     /* ZERO, DATA, BSS all refer to the RAM. */
     freespacemap freespace_data;
+    freespace_data.SetPackTimeBudget(PackTimeBudget);
+    freespace_data.SetThreadPool(&pool);
 
     /* First link the zeropage. It may only use 8-bit addresses. */
     freespace_data.Add(0x7E0000, 0x100);
-    freespace_data.OrganizeO65linker(linker, ZERO);
+    ReservePlaced(freespace_data, linker, DATA);
+    ReservePlaced(freespace_data, linker, BSS);
+    Organize(freespace_data, linker, ZERO);
 
     /* Then link data and bss. They are interchangeable.
      * If 8-bit addresses remained free from the zeropage segment,
@@ -506,13 +1189,45 @@ int main(int argc, char** argv)
      */
     freespace_data.Add(0x7E0100, GetPageSize() - 0x100);
     freespace_data.Add(0x7F0000, GetPageSize());
-    freespace_data.OrganizeO65linker(linker, DATA);
-    freespace_data.OrganizeO65linker(linker, BSS);
+    ReservePlaced(freespace_data, linker, DATA);
+    ReservePlaced(freespace_data, linker, BSS);
+    Organize(freespace_data, linker, DATA);
+    Organize(freespace_data, linker, BSS);
     
-    linker.Link();
+    if(!SpaceReportFile.empty())
+    {
+        SpaceReports.Print(stderr);
+        SpaceReports.WriteJSON(SpaceReportFile);
+    }
+    
+    linker.Link(&pool);
+    
+    if(ShowStats)
+        linker.GetSymbolStats().Print(stderr, "Global symbols");
+    
+    if(!MapFile.empty())
+        WriteLinkMap(MapFile, linker, freespace_code, freespace_data);
+    
+    if(!IncrementalFile.empty())
+    {
+        RecordLinkState(linker, CurrentLink, GetObjectKeys(linker), from_o65, wishes);
+        CurrentLink.address_type = address_type;
+        CurrentLink.fastrom      = IsFastROM();
+        CurrentLink.output_name  = outfn;
+        CompareLinkStates(PreviousLink, CurrentLink, IncrementalUpdate);
+        
+        /* Patches are not remembered, so always write them */
+        const std::vector<LinkPatch>& patches = linker.GetPatches();
+        for(unsigned a=0; a<patches.size(); ++a)
+            IncrementalUpdate.write.push_back(
+                std::make_pair(patches[a].address, (unsigned)patches[a].bytes.size()));
+    }
     
     WriteOut(linker, output ? output : stdout);
     if(output) fclose(output);
     
+    if(!IncrementalFile.empty())
+        CurrentLink.Save(IncrementalFile);
+    
     return 0;
 }
@@ -0,0 +1,191 @@
+#include <cstdio>
+#include <algorithm>
+#include <vector>
+
+#include "linkmap.hh"
+#include "o65linker.hh"
+#include "space.hh"
+
+namespace
+{
+    const SegmentSelection Segs[4] = { CODE, DATA, ZERO, BSS };
+
+    struct MapSymbol
+    {
+        unsigned    address;
+        std::string name;
+        unsigned    objno;
+
+        bool operator< (const MapSymbol& b) const
+        {
+            if(address != b.address) return address < b.address;
+            return name < b.name;
+        }
+    };
+
+    unsigned NameHash(const std::string& name)
+    {
+        unsigned h = 2166136261U;
+        for(unsigned a=0; a<name.size(); ++a)
+            h = (h ^ (unsigned char)name[a]) * 16777619U;
+        return h;
+    }
+
+    void PutD(std::vector<unsigned char>& buf, unsigned w)
+    {
+        buf.push_back(w & 255);
+        buf.push_back((w >> 8) & 255);
+        buf.push_back((w >> 16) & 255);
+        buf.push_back((unsigned char)(w >> 24));
+    }
+
+    void DumpFreeSpace(std::FILE* fp, const char* title, const freespacemap& space)
+    {
+        std::fprintf(fp, "\n%s free space:\n", title);
+
+        unsigned total = 0;
+        for(freespacemap::const_iterator
+            i = space.begin(); i != space.end(); ++i)
+        {
+            unsigned free = 0, largest = 0, hunks = 0;
+            for(freespaceset::const_iterator
+                j = i->second.begin(); j != i->second.end(); ++j)
+            {
+                unsigned len = j->upper - j->lower;
+                free += len;
+                if(len > largest) largest = len;
+                ++hunks;
+            }
+            if(!hunks) continue;
+            std::fprintf(fp, "  bank $%02X: %6u bytes free in %3u hunk(s), largest %u\n",
+                i->first, free, hunks, largest);
+            total += free;
+        }
+        std::fprintf(fp, "  total: %u bytes\n", total);
+    }
+
+    bool WriteIndex(const std::string& filename, const std::vector<MapSymbol>& symbols)
+    {
+        const unsigned count = (unsigned)symbols.size();
+
+        unsigned buckets = 1;
+        while(buckets < count * 2) buckets <<= 1;
+
+        std::vector<unsigned char> strings;
+        std::vector<unsigned> nameoffs(count);
+        for(unsigned a=0; a<count; ++a)
+        {
+            nameoffs[a] = (unsigned)strings.size();
+            strings.insert(strings.end(), symbols[a].name.begin(), symbols[a].name.end());
+            strings.push_back(0);
+        }
+
+        std::vector<unsigned> table(buckets, 0);
+        for(unsigned a=0; a<count; ++a)
+        {
+            unsigned b = NameHash(symbols[a].name) & (buckets-1);
+            while(table[b]) b = (b+1) & (buckets-1);
+            table[b] = a+1;
+        }
+
+        const unsigned HeaderSize = 8 + 6*4;
+        const unsigned addrtab = HeaderSize;
+        const unsigned hashtab = addrtab + count * 8;
+        const unsigned strpool = hashtab + buckets * 4;
+
+        std::vector<unsigned char> buf;
+        buf.reserve(strpool + strings.size());
+        const char Magic[] = "SNLKMAP1";
+        buf.insert(buf.end(), Magic, Magic + 8);
+        PutD(buf, count);
+        PutD(buf, buckets);
+        PutD(buf, addrtab);
+        PutD(buf, hashtab);
+        PutD(buf, strpool);
+        PutD(buf, (unsigned)strings.size());
+        for(unsigned a=0; a<count; ++a)
+        {
+            PutD(buf, symbols[a].address);
+            PutD(buf, nameoffs[a]);
+        }
+        for(unsigned a=0; a<buckets; ++a)
+            PutD(buf, table[a]);
+        buf.insert(buf.end(), strings.begin(), strings.end());
+
+        std::FILE* fp = std::fopen(filename.c_str(), "wb");
+        if(!fp)
+        {
+            std::perror(filename.c_str());
+            return false;
+        }
+        bool ok = std::fwrite(&buf[0], 1, buf.size(), fp) == buf.size();
+        if(std::fclose(fp) != 0) ok = false;
+        if(!ok) std::perror(filename.c_str());
+        return ok;
+    }
+}
+
+bool WriteLinkMap(const std::string& filename,
+                  const O65linker& linker,
+                  const freespacemap& rom_space,
+                  const freespacemap& ram_space)
+{
+    std::FILE* fp = std::fopen(filename.c_str(), "wt");
+    if(!fp)
+    {
+        std::perror(filename.c_str());
+        return false;
+    }
+
+    const unsigned n = linker.GetObjectCount();
+
+    std::vector<unsigned> addrs[4], sizes[4];
+    for(unsigned s=0; s<4; ++s)
+    {
+        addrs[s] = linker.GetAddrList(Segs[s]);
+        sizes[s] = linker.GetSizeList(Segs[s]);
+    }
+
+    std::vector<MapSymbol> symbols;
+
+    std::fprintf(fp, "Objects:\n");
+    for(unsigned a=0; a<n; ++a)
+    {
+        std::fprintf(fp, "  %s\n", linker.GetName(a).c_str());
+        for(unsigned s=0; s<4; ++s)
+        {
+            if(sizes[s][a])
+                std::fprintf(fp, "    %-4s $%06X size $%04X\n",
+                    GetSegmentName(Segs[s]).c_str(), addrs[s][a], sizes[s][a]);
+
+            const std::vector<pair<std::string, unsigned> >
+                syms = linker.GetSymbols(a, Segs[s]);
+            for(unsigned b=0; b<syms.size(); ++b)
+            {
+                MapSymbol sym;
+                sym.address = syms[b].second;
+                sym.name    = syms[b].first;
+                sym.objno   = a;
+                symbols.push_back(sym);
+            }
+        }
+    }
+
+    DumpFreeSpace(fp, "ROM", rom_space);
+    DumpFreeSpace(fp, "RAM", ram_space);
+
+    std::sort(symbols.begin(), symbols.end());
+
+    std::fprintf(fp, "\nSymbols:\n");
+    for(unsigned a=0; a<symbols.size(); ++a)
+        std::fprintf(fp, "  $%06X %-32s %s\n",
+            symbols[a].address,
+            symbols[a].name.c_str(),
+            linker.GetName(symbols[a].objno).c_str());
+
+    bool ok = !std::ferror(fp);
+    if(std::fclose(fp) != 0) ok = false;
+    if(!ok) std::perror(filename.c_str());
+
+    return WriteIndex(filename + ".idx", symbols) && ok;
+}
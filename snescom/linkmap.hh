@@ -0,0 +1,36 @@
+#ifndef bqtLinkMapHH
+#define bqtLinkMapHH
+
+#include <string>
+
+class O65linker;
+class freespacemap;
+
+/* Writes the link map of a finished link.
+ *
+ * <filename> gets a text map: where each object's segments went,
+ * the free space left in each bank, and all symbols by address.
+ *
+ * <filename>.idx gets a binary index meant to be mapped into
+ * memory as is. All numbers are 32-bit little-endian.
+ *
+ *   header:  "SNLKMAP1"
+ *            symbol count, bucket count (a power of 2),
+ *            offsets of the address table, the hash table
+ *            and the string pool, and the string pool size
+ *   address table: for each symbol, sorted by address:
+ *            address, offset of the name in the string pool
+ *   hash table: for each bucket, 1 + index into the address
+ *            table, or 0 if empty. The first bucket tried is
+ *            FNV-1a(name) & (buckets-1); on collision, the next.
+ *   string pool: NUL-terminated names.
+ *
+ * Address lookups are binary searches in the address table;
+ * name lookups are a probe or two in the hash table.
+ */
+bool WriteLinkMap(const std::string& filename,
+                  const O65linker& linker,
+                  const freespacemap& rom_space,
+                  const freespacemap& ram_space);
+
+#endif
@@ -5,6 +5,9 @@
 #include "assemble.hh"
 #include "precompile.hh"
 #include "warning.hh"
+#include "bps.hh"
+#include "hash.hh"
+#include "romaddr.hh"
 
 #include <getopt.h>
 
@@ -17,7 +20,8 @@ namespace
     {
         IPSformat,
         O65format,
-        RAWformat
+        RAWformat,
+        BPSformat
     } format = O65format;
 
     void SetOutputFormat(const std::string& s)
@@ -25,6 +29,7 @@ namespace
         if(s == "ips") format = IPSformat;
         else if(s == "o65") format = O65format;
         else if(s == "raw") format = RAWformat;
+        else if(s == "bps") format = BPSformat;
         else
         {
             std::fprintf(stderr, "Error: Unknown output format `%s'\n", s.c_str());
@@ -39,6 +44,8 @@ int main(int argc, char**argv)
     
     std::FILE *output = NULL;
     std::string outfn;
+    std::vector<unsigned char> bps_source;
+    bool show_stats = false;
  
     for(;;)
     {
@@ -55,6 +62,9 @@ int main(int argc, char**argv)
             {"outformat", 0,0,'f'},
             {"out_ips",   0,0,'I'},
             {"warn",      0,0,'W'},
+            {"bps-source",1,0,502},
+            {"stats",     0,0,503},
+            {"fastrom",   0,0,504},
             {0,0,0,0}
         };
         int c = getopt_long(argc,argv, "hVo:EcJf:IW:", long_options, &option_index);
@@ -93,6 +103,21 @@ int main(int argc, char**argv)
                 break;
             }
             
+            case 502: //bps-source
+            {
+                if(!LoadBinaryFile(optarg, bps_source))
+                    goto ErrorExit;
+                break;
+            }
+            
+            case 503: //stats
+                show_stats = true;
+                break;
+            
+            case 504: //fastrom
+                SetFastROM(true);
+                break;
+            
             case 'I': SetOutputFormat("ips"); break;
             
             case 'h':
@@ -110,9 +135,12 @@ int main(int argc, char**argv)
                     " --jumps, -J           Automatically correct short jumps\n"
                     " --version             Displays version information\n"
                     " --submethod <method>  Select subprocess method: temp,thread,pipe\n"
-                    " -f, --outformat <fmt> Select output format: ips,raw,o65 (default: o65)\n"
+                    " -f, --outformat <fmt> Select output format: ips,raw,o65,bps (default: o65)\n"
                     "                         -I is short for -fips\n"
+                    " --bps-source <file>   The ROM that a BPS patch applies to (default: none)\n"
                     " -W <type>             Enable warnings\n"
+                    " --stats               Show statistics about the symbol tables\n"
+                    " --fastrom             Put ROM addresses in the $80-$FF banks (like .fastrom)\n"
                     "\nNo warranty whatsoever.\n",
                     argv[0]);
                 return 0;
@@ -248,8 +276,14 @@ Reprocess:
             case RAWformat:
                 obj.WriteRAW(stream);
                 break;
+            case BPSformat:
+                obj.WriteBPS(stream, bps_source);
+                break;
         }
         obj.Dump();
+        
+        if(show_stats)
+            obj.GetLabelStats().Print(stderr, "Labels");
     }
     
     if(output) fclose(output);
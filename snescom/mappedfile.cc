@@ -0,0 +1,61 @@
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+# include <sys/mman.h>
+# define USE_MMAP
+#endif
+
+#include "mappedfile.hh"
+
+MappedFile::MappedFile()
+    : data(NULL), size(0), mapped(false), buffer(), refcount(1)
+{
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef USE_MMAP
+    if(mapped) munmap(const_cast<unsigned char*>(data), size);
+#endif
+}
+
+MappedFile* MappedFile::Open(std::FILE* fp)
+{
+    MappedFile* result = new MappedFile;
+
+#ifdef USE_MMAP
+    struct stat st;
+    int fd = fileno(fp);
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(ptr != MAP_FAILED)
+        {
+            result->data   = (const unsigned char*)ptr;
+            result->size   = (unsigned)st.st_size;
+            result->mapped = true;
+            return result;
+        }
+    }
+#endif
+
+    /* Not mappable, so read it. */
+    std::rewind(fp);
+    std::clearerr(fp);
+    for(;;)
+    {
+        unsigned char Buf[4096];
+        size_t n = std::fread(Buf, 1, sizeof(Buf), fp);
+        result->buffer.insert(result->buffer.end(), Buf, Buf + n);
+        if(n < sizeof(Buf)) break;
+    }
+    if(std::ferror(fp))
+    {
+        delete result;
+        return NULL;
+    }
+    result->size = (unsigned)result->buffer.size();
+    result->data = result->size ? &result->buffer[0] : NULL;
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef bqtMappedFileHH
+#define bqtMappedFileHH
+
+#include <cstdio>
+#include <vector>
+
+/* A read-only view of a whole file.
+ *
+ * Regular files are mapped to memory; anything else (pipes,
+ * systems without mmap) is read into a buffer instead.
+ * The contents stay valid while somebody holds a reference.
+ */
+class MappedFile
+{
+public:
+    /* Returns NULL on error. The caller owns the first reference. */
+    static MappedFile* Open(std::FILE* fp);
+
+    void AddRef() { ++refcount; }
+    void Release() { if(!--refcount) delete this; }
+
+    const unsigned char* GetData() const { return data; }
+    unsigned GetSize() const { return size; }
+
+private:
+    MappedFile();
+    ~MappedFile();
+
+    const unsigned char* data;
+    unsigned size;
+    bool mapped;
+    std::vector<unsigned char> buffer;
+    unsigned refcount;
+
+private:
+    MappedFile(const MappedFile&);
+    void operator=(const MappedFile&);
+};
+
+#endif
@@ -10,8 +10,12 @@
 
 #include <map>
 #include <set>
+#include <cstring>
+#include <algorithm>
 
 #include "o65.hh"
+#include "mappedfile.hh"
+#include "hash.hh"
 
 using std::set;
 using std::map;
@@ -27,85 +31,248 @@ using std::stderr;
 
 namespace
 {
-    unsigned LoadWord(FILE *fp)
+    /* Reads little-endian values from a buffer,
+     * remembering whether it ran past the end.
+     */
+    class O65reader
     {
-        unsigned temp = fgetc(fp);
-        if(temp == (unsigned)EOF)return temp;
-        return temp | (fgetc(fp) << 8);
+        const unsigned char* ptr;
+        const unsigned char* end;
+        bool ok;
+    public:
+        O65reader(const unsigned char* data, unsigned size)
+            : ptr(data), end(data + size), ok(true) { }
+        
+        bool Ok() const { return ok; }
+        unsigned Left() const { return (unsigned)(end - ptr); }
+        const unsigned char* GetPtr() const { return ptr; }
+        
+        unsigned Byte()
+        {
+            if(ptr >= end) { ok = false; return 0; }
+            return *ptr++;
+        }
+        unsigned Word()
+        {
+            if(end - ptr < 2) { ok = false; ptr = end; return 0; }
+            unsigned result = ptr[0] | (ptr[1] << 8);
+            ptr += 2;
+            return result;
+        }
+        unsigned DWord()
+        {
+            unsigned lo = Word();
+            return lo | (Word() << 16);
+        }
+        unsigned SWord(bool use32)
+        {
+            return use32 ? DWord() : Word();
+        }
+        const unsigned char* Skip(unsigned n)
+        {
+            const unsigned char* result = ptr;
+            if(Left() < n) { ok = false; ptr = end; return result; }
+            ptr += n;
+            return result;
+        }
+        /* A NUL-terminated string */
+        const std::string String()
+        {
+            const unsigned char* begin = ptr;
+            while(ptr < end && *ptr) ++ptr;
+            if(ptr >= end) { ok = false; return std::string(); }
+            return std::string((const char*)begin, (const char*)ptr++);
+        }
+    };
+}
+
+/* Contents of a segment. Contents loaded from a file are
+ * borrowed from the mapped file, and copied only when
+ * something is about to modify them.
+ */
+class O65::SegmentSpace
+{
+    MappedFile* file; /* non-NULL while borrowing */
+    const unsigned char* borrowed;
+    unsigned borrowed_size;
+    
+    mutable vector<unsigned char> owned;
+public:
+    SegmentSpace(): file(NULL), borrowed(NULL), borrowed_size(0), owned() { }
+    ~SegmentSpace() { Unborrow(); }
+    
+    SegmentSpace(const SegmentSpace& b)
+        : file(b.file), borrowed(b.borrowed), borrowed_size(b.borrowed_size), owned(b.owned)
+    {
+        if(file) file->AddRef();
     }
-    unsigned LoadDWord(FILE *fp)
+    SegmentSpace& operator= (const SegmentSpace& b)
     {
-        unsigned temp = LoadWord(fp);
-        if(temp == (unsigned)EOF) return temp;
-        unsigned temp2 = LoadWord(fp);
-        if(temp2 == (unsigned)EOF) return temp2;
-        return temp | (temp2 << 16);
+        if(b.file) b.file->AddRef();
+        Unborrow();
+        file = b.file; borrowed = b.borrowed; borrowed_size = b.borrowed_size;
+        owned = b.owned;
+        return *this;
     }
-    unsigned LoadSWord(FILE *fp, bool use32)
+    SegmentSpace& operator= (const vector<unsigned char>& buf)
     {
-        return use32 ? LoadDWord(fp) : LoadWord(fp);
+        Unborrow();
+        owned = buf;
+        return *this;
     }
-}
+    
+    void Borrow(MappedFile* f, const unsigned char* data, unsigned size)
+    {
+        f->AddRef();
+        Unborrow();
+        owned.clear();
+        file = f; borrowed = data; borrowed_size = size;
+    }
+    
+    unsigned size() const { return file ? borrowed_size : (unsigned)owned.size(); }
+    
+    unsigned char operator[] (unsigned pos) const
+    {
+        return file ? borrowed[pos] : owned[pos];
+    }
+    unsigned char& operator[] (unsigned pos)
+    {
+        if(file) MakeOwned();
+        return owned[pos];
+    }
+    void resize(unsigned newsize)
+    {
+        if(file) MakeOwned();
+        owned.resize(newsize);
+    }
+    
+    /* The contents as a vector; this stops borrowing. */
+    const vector<unsigned char>& GetVector() const
+    {
+        if(file) const_cast<SegmentSpace&>(*this).MakeOwned();
+        return owned;
+    }
+    
+private:
+    void MakeOwned()
+    {
+        owned.assign(borrowed, borrowed + borrowed_size);
+        Unborrow();
+    }
+    void Unborrow()
+    {
+        if(file) file->Release();
+        file = NULL; borrowed = NULL; borrowed_size = 0;
+    }
+};
+
+/* A list of names, numbered in the order they were added,
+ * with a hash index for finding them. Copies share the same
+ * list until one of them adds a name.
+ */
+class O65::NameTable
+{
+    struct Shared
+    {
+        StringHashMap<unsigned> index;
+        vector<std::string> names;
+        unsigned refcount;
+        
+        Shared(): index(), names(), refcount(1) { }
+    };
+    Shared* shared;
+public:
+    NameTable(): shared(new Shared) { }
+    ~NameTable() { if(!--shared->refcount) delete shared; }
+    NameTable(const NameTable& b): shared(b.shared) { ++shared->refcount; }
+    NameTable& operator= (const NameTable& b)
+    {
+        ++b.shared->refcount;
+        if(!--shared->refcount) delete shared;
+        shared = b.shared;
+        return *this;
+    }
+    
+    unsigned size() const { return (unsigned)shared->names.size(); }
+    const std::string& operator[] (unsigned n) const { return shared->names[n]; }
+    
+    /* Returns ~0U if not found */
+    unsigned Find(const std::string& name) const
+    {
+        StringHashMap<unsigned>::const_iterator i = shared->index.find(name);
+        if(i == shared->index.end()) return ~0U;
+        return i->second;
+    }
+    unsigned Add(const std::string& name)
+    {
+        if(shared->refcount > 1)
+        {
+            Shared* copy = new Shared(*shared);
+            copy->refcount = 1;
+            --shared->refcount;
+            shared = copy;
+        }
+        unsigned n = (unsigned)shared->names.size();
+        shared->names.push_back(name);
+        shared->index[name] = n;
+        return n;
+    }
+};
 
 class O65::Defs
 {
-    std::map<std::string, unsigned> symno;
-    std::map<unsigned, std::string> nosym;
-    std::set<unsigned> undefines;
-    std::map<unsigned, unsigned> defines;
+    NameTable names;        // by symno
+    vector<unsigned> values; // by symno
+    vector<bool> defined;    // by symno
 public:
-    Defs(): symno(), nosym(), undefines(), defines()
+    Defs(): names(), values(), defined()
     {
     }
     
     unsigned AddUndefined(const std::string& name)
     {
-        unsigned a = symno.size();
-        undefines.insert(a);
-        symno[name] = a;
-        nosym[a] = name;
+        unsigned a = names.Add(name);
+        values.push_back(0);
+        defined.push_back(false);
         return a;
     }
     unsigned GetSymno(const std::string& name) const
     {
-        std::map<std::string, unsigned>::const_iterator i = symno.find(name);
-        if(i == symno.end()) return ~0U;
-        return i->second;
+        return names.Find(name);
+    }
+    const std::string& GetName(unsigned a) const
+    {
+        return names[a];
     }
     bool IsDefined(unsigned a) const
     {
-        return defines.find(a) != defines.end();
+        return defined[a];
     }
     unsigned GetValue(unsigned a) const
     {
-        return defines.find(a)->second;
+        return values[a];
     }
     void Define(unsigned a, unsigned value)
     {
-        undefines.erase(a);
-        defines[a] = value;
+        defined[a] = true;
+        values[a] = value;
     }
     const vector<std::string> GetExternList() const
     {
         vector<std::string> result;
-        result.reserve(undefines.size());
-        for(std::set<unsigned>::const_iterator
-            i = undefines.begin(); i != undefines.end(); ++i)
-        {
-            const std::string& name = nosym.find(*i)->second;
-            result.push_back(name);
-        }
+        for(unsigned a=0; a<names.size(); ++a)
+            if(!defined[a])
+                result.push_back(names[a]);
         return result;
     }
     void DumpUndefines() const
     {
-        for(std::set<unsigned>::const_iterator
-            i = undefines.begin(); i != undefines.end(); ++i)
+        for(unsigned a=0; a<names.size(); ++a)
         {
-            const std::string& name = nosym.find(*i)->second;
-
+            if(defined[a]) continue;
+            
             fprintf(stderr, "Symbol %s is still not defined\n",
-                name.c_str());
+                names[a].c_str());
         }
     }
 };
@@ -113,26 +280,70 @@ public:
 class O65::Segment
 {
 public:
-    vector<unsigned char> space;
+    SegmentSpace space;
 
     //! where it is assumed to start
     unsigned base;
     
-    //! absolute addresses of all publics
-    typedef map<std::string, unsigned> publicmap_t;
-    publicmap_t publics;
+    //! names and absolute addresses of all publics
+    NameTable pubnames;
+    vector<unsigned> pubaddrs;
 
 public:    
     typedef Relocdata<unsigned> RT; RT R;
+    
+    //! for each symbol number, which relocs refer to it
+    enum RelocKind { R16, R16lo, R16hi, R24, R24seg };
+    typedef pair<RelocKind, unsigned> symreloc_t; // kind, index in R.xxx.Relocs
+    vector<vector<symreloc_t> > symrelocs;
+    
+    //! number of O65 objects sharing this segment
+    unsigned refcount;
 public:
-    Segment(): space(), base(0), publics(), R()
+    Segment(): space(), base(0), pubnames(), pubaddrs(), R(), symrelocs(), refcount(1)
     {
     }
+    
+    static Segment* Share(Segment* s)
+    {
+        if(s) ++s->refcount;
+        return s;
+    }
+    static void Release(Segment* s)
+    {
+        if(s && !--s->refcount) delete s;
+    }
+    /* Makes sure nobody else sees the changes to be made to s */
+    static Segment* Unshare(Segment*& s)
+    {
+        if(s && s->refcount > 1)
+        {
+            Segment* copy = new Segment(*s);
+            copy->refcount = 1;
+            --s->refcount;
+            s = copy;
+        }
+        return s;
+    }
+    
+    bool RefersTo(unsigned symno) const
+    {
+        return symno < symrelocs.size() && !symrelocs[symno].empty();
+    }
 private:
     friend class O65;
     void Locate(SegmentSelection seg, unsigned diff, bool is_me);
     void LocateSym(unsigned symno, unsigned newaddress);
-    void LoadRelocations(FILE* fp);
+    bool LoadRelocations(O65reader& reader, unsigned num_und, std::string& messages);
+    
+    template<typename RelocList>
+    void AddReloc(RelocList& list, RelocKind kind,
+                  const typename RelocList::Type& addr, unsigned symno)
+    {
+        if(symno >= symrelocs.size()) symrelocs.resize(symno + 1);
+        symrelocs[symno].push_back(symreloc_t(kind, list.Relocs.size()));
+        list.AddReloc(addr, symno);
+    }
 };
 
 O65::O65()
@@ -148,143 +359,212 @@ O65::O65()
 
 O65::~O65()
 {
-    delete code;
-    delete data;
-    delete zero;
-    delete bss;
+    Segment::Release(code);
+    Segment::Release(data);
+    Segment::Release(zero);
+    Segment::Release(bss);
     delete defs;
 }
 
+/* Copies share the segments until either one modifies them. */
 O65::O65(const O65& b)
     : customheaders(),
       defs(new Defs(*b.defs)),
-      code(b.code ? new Segment(*b.code) : NULL),
-      data(b.data ? new Segment(*b.data) : NULL),
-      zero(b.zero ? new Segment(*b.zero) : NULL),
-      bss(b.bss ? new Segment(*b.bss) : NULL),
+      code(Segment::Share(b.code)),
+      data(Segment::Share(b.data)),
+      zero(Segment::Share(b.zero)),
+      bss(Segment::Share(b.bss)),
       error(b.error)
 {
 }
 const O65& O65::operator= (const O65& b)
 {
     if(&b == this) return *this;
-    delete code; code = b.code ? new Segment(*b.code) : NULL;
-    delete data; data = b.data ? new Segment(*b.data) : NULL;
-    delete zero; zero = b.zero ? new Segment(*b.zero) : NULL;
-    delete bss; bss = b.bss ? new Segment(*b.bss) : NULL;
+    Segment::Release(code); code = Segment::Share(b.code);
+    Segment::Release(data); data = Segment::Share(b.data);
+    Segment::Release(zero); zero = Segment::Share(b.zero);
+    Segment::Release(bss); bss = Segment::Share(b.bss);
     delete defs; defs = new Defs(*b.defs);
     return *this;
 }
 
-void O65::Load(FILE* fp)
+void O65::swap(O65& b)
+{
+    customheaders.swap(b.customheaders);
+    std::swap(defs, b.defs);
+    std::swap(code, b.code);
+    std::swap(data, b.data);
+    std::swap(zero, b.zero);
+    std::swap(bss,  b.bss);
+    std::swap(error, b.error);
+}
+
+bool O65::Load(FILE* fp)
 {
-    rewind(fp);
+    std::string messages;
+    bool ok = Load(fp, messages);
+    fprintf(stderr, "%s", messages.c_str());
+    return ok;
+}
+
+bool O65::Load(MappedFile* file)
+{
+    std::string messages;
+    bool ok = Load(file, messages);
+    fprintf(stderr, "%s", messages.c_str());
+    return ok;
+}
+
+bool O65::Load(FILE* fp, std::string& messages)
+{
+    MappedFile* file = MappedFile::Open(fp);
+    if(!file)
+    {
+        messages += "O65: Error reading the object file\n";
+        return false;
+    }
+    bool ok = Load(file, messages);
+    file->Release();
+    return ok;
+}
+
+bool O65::Load(MappedFile* file, std::string& messages)
+{
+    O65reader reader(file->GetData(), file->GetSize());
+    char Buf[128];
     
-    /* FIXME: No validity checks here */
-    // Skip header
-    LoadWord(fp);LoadWord(fp);LoadWord(fp);
+    static const unsigned char Magic[5] = { 0x01,0x00, 'o','6','5' };
+    const unsigned char* magic = reader.Skip(5);
+    if(!reader.Ok() || std::memcmp(magic, Magic, 5) != 0)
+    {
+        messages += "O65: Not an o65 object file\n";
+        return false;
+    }
+    
+    unsigned version = reader.Byte();
+    if(version != 0)
+    {
+        std::sprintf(Buf, "O65: Unsupported o65 version %u\n", version);
+        messages += Buf;
+        return false;
+    }
     
-    /* FIXME: No validity checks here */
-    // Skip mode
-    unsigned mode = LoadWord(fp);
+    unsigned mode = reader.Word();
     
     bool use32 = mode & 0x2000;
     
-    if(this->code) delete this->code;
-    if(this->data) delete this->data;
-    if(this->zero) delete this->zero;
-    if(this->bss) delete this->bss;
+    Segment::Release(this->code);
+    Segment::Release(this->data);
+    Segment::Release(this->zero);
+    Segment::Release(this->bss);
 
     this->code = new Segment;
     this->data = new Segment;
     this->zero = new Segment;
     this->bss = new Segment;
+    customheaders.clear();
     
-    this->code->base = LoadSWord(fp, use32);
-    this->code->space.resize(LoadSWord(fp, use32));
-
-    this->data->base = LoadSWord(fp, use32);
-    this->data->space.resize(LoadSWord(fp, use32));
+    unsigned sizes[4];
     
-    this->bss->base = LoadSWord(fp, use32);
-    this->bss->space.resize(LoadSWord(fp, use32));
+    this->code->base = reader.SWord(use32);
+    sizes[0] = reader.SWord(use32);
+
+    this->data->base = reader.SWord(use32);
+    sizes[1] = reader.SWord(use32);
     
-    this->zero->base = LoadSWord(fp, use32);
-    this->zero->space.resize(LoadSWord(fp, use32));
+    this->bss->base = reader.SWord(use32);
+    this->bss->space.resize(reader.SWord(use32));
     
-    LoadSWord(fp, use32); // Skip stack_len
+    this->zero->base = reader.SWord(use32);
+    this->zero->space.resize(reader.SWord(use32));
     
-    //fprintf(stderr, "@%X: stack len\n", ftell(fp));
+    reader.SWord(use32); // Skip stack_len
     
     // Skip some headers
     for(;;)
     {
-        unsigned len = fgetc(fp);
-        if(!len || len == (unsigned)EOF)break;
-        
-        len &= 0xFF;
+        unsigned len = reader.Byte();
+        if(!len || !reader.Ok()) break;
         
-        unsigned char type = fgetc(fp);
+        unsigned char type = (unsigned char)reader.Byte();
         if(len >= 2) len -= 2; else len = 0;
         
-        std::string data(len, '\0');
+        const unsigned char* begin = reader.Skip(len);
+        if(!reader.Ok()) break;
         
-        for(unsigned a=0; a<len; ++a) data[a] = fgetc(fp);
+        std::string data((const char*)begin, len);
         
         //fprintf(stderr, "Custom header %u: '%.*s'\n", type, len, data.data());
         
         customheaders.push_back(make_pair(type, data));
     }
     
-    fread(&this->code->space[0], this->code->space.size(), 1, fp);
-    fread(&this->data->space[0], this->data->space.size(), 1, fp);
+    if(!reader.Ok() || reader.Left() < sizes[0] || reader.Left() - sizes[0] < sizes[1])
+    {
+        messages += "O65: Object file is truncated\n";
+        return false;
+    }
+    
+    this->code->space.Borrow(file, reader.Skip(sizes[0]), sizes[0]);
+    this->data->space.Borrow(file, reader.Skip(sizes[1]), sizes[1]);
     // zero and bss Segments don't exist in o65 format.
     
     // load external symbols
     
-    unsigned num_und = LoadSWord(fp, use32);
-
-    //fprintf(stderr, "@%X: %u externs..\n", ftell(fp), num_und);
+    unsigned num_und = reader.SWord(use32);
 
-    for(unsigned a=0; a<num_und; ++a)
+    for(unsigned a=0; a<num_und && reader.Ok(); ++a)
     {
-        std::string varname;
-        while(int c = fgetc(fp)) { if(c==EOF)break; varname += (char) c; }
-        
-        defs->AddUndefined(varname);
+        defs->AddUndefined(reader.String());
     }
     
-    //fprintf(stderr, "@%X: code relocs..\n", ftell(fp));
-    
-    code->LoadRelocations(fp);
-
-    //fprintf(stderr, "@%X: data relocs..\n", ftell(fp));
-
-    data->LoadRelocations(fp);
+    bool ok = reader.Ok()
+           && code->LoadRelocations(reader, num_und, messages)
+           && data->LoadRelocations(reader, num_und, messages);
     // relocations don't exist for zero/bss in o65 format.
     
-    unsigned num_global = LoadSWord(fp, use32);
-    
-    //fprintf(stderr, "@%X: %u globals\n", ftell(fp), num_global);
+    unsigned num_global = ok ? reader.SWord(use32) : 0;
     
-    for(unsigned a=0; a<num_global; ++a)
+    for(unsigned a=0; a<num_global && reader.Ok(); ++a)
     {
-        std::string varname;
-        while(int c = fgetc(fp)) { if(c==EOF)break; varname += (char) c; }
+        std::string varname = reader.String();
         
-        SegmentSelection seg = (SegmentSelection)fgetc(fp);
+        SegmentSelection seg = (SegmentSelection)reader.Byte();
         
-        unsigned value = LoadSWord(fp, use32);
+        unsigned value = reader.SWord(use32);
+        if(!reader.Ok()) break;
+        
+        if(seg != CODE && seg != DATA && seg != ZERO && seg != BSS)
+        {
+            std::sprintf(Buf, " is in an unknown segment %u\n", (unsigned)seg);
+            messages += "O65: Global " + varname + Buf;
+            ok = false;
+            break;
+        }
         
         DeclareGlobal(seg, varname, value);
     }
+    
+    if(!ok || !reader.Ok())
+    {
+        messages += "O65: Object file is corrupt or truncated\n";
+        return false;
+    }
+    return true;
 }
 
 void O65::DeclareGlobal(SegmentSelection seg, const std::string& name, unsigned address)
 {
     if(Segment**s = GetSegRef(seg))
     {
-        (*s)->publics[name] = address;
+        unsigned n = (*s)->pubnames.Find(name);
+        if(n == ~0U)
+        {
+            (*s)->pubnames.Add(name);
+            (*s)->pubaddrs.push_back(address);
+        }
+        else
+            (*s)->pubaddrs[n] = address;
     }
 }
 
@@ -295,10 +575,10 @@ void O65::Locate(SegmentSelection seg, unsigned newaddress)
     
     unsigned diff = newaddress - (*s)->base;
     
-    if(code) code->Locate(seg, diff, seg==CODE);
-    if(data) data->Locate(seg, diff, seg==DATA);
-    if(zero) zero->Locate(seg, diff, seg==ZERO);
-    if(bss)   bss->Locate(seg, diff, seg==BSS);
+    if(Segment::Unshare(code)) code->Locate(seg, diff, seg==CODE);
+    if(Segment::Unshare(data)) data->Locate(seg, diff, seg==DATA);
+    if(Segment::Unshare(zero)) zero->Locate(seg, diff, seg==ZERO);
+    if(Segment::Unshare(bss))   bss->Locate(seg, diff, seg==BSS);
 }
 
 unsigned O65::GetBase(SegmentSelection seg) const
@@ -328,24 +608,29 @@ void O65::LinkSym(const std::string& name, unsigned value)
             oldvalue
                );
     }
-    if(code) code->LocateSym(symno, value);
-    if(data) data->LocateSym(symno, value);
-    if(zero) zero->LocateSym(symno, value);
-    if(bss) bss->LocateSym(symno, value);
+    if(code && code->RefersTo(symno)) Segment::Unshare(code)->LocateSym(symno, value);
+    if(data && data->RefersTo(symno)) Segment::Unshare(data)->LocateSym(symno, value);
+    if(zero && zero->RefersTo(symno)) Segment::Unshare(zero)->LocateSym(symno, value);
+    if(bss  &&  bss->RefersTo(symno)) Segment::Unshare(bss)->LocateSym(symno, value);
         
     defs->Define(symno, value);
 }
 
+void O65::Detach()
+{
+    Segment** segs[4] = { &code, &data, &zero, &bss };
+    for(unsigned a=0; a<4; ++a)
+        if(Segment::Unshare(*segs[a]))
+            (*segs[a])->space.GetVector();
+}
+
 void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
 {
     if(is_me)
     {
         /* Relocate publics */
-        map<std::string, unsigned>::iterator i;
-        for(i = publics.begin(); i != publics.end(); ++i)
-        {
-            i->second += diff;
-        }
+        for(unsigned a=0; a<pubaddrs.size(); ++a)
+            pubaddrs[a] += diff;
     }
     
     /* Fix all references to symbols in the given seg */
@@ -437,68 +722,77 @@ void O65::Segment::Locate(SegmentSelection seg, unsigned diff, bool is_me)
 void O65::Segment::LocateSym(unsigned symno, unsigned value)
 {
     /* Locate an external symbol */
+    if(symno >= symrelocs.size()) return;
 
     /* Fix all references to it */
-    for(unsigned a=0; a<R.R16.Relocs.size(); ++a)
+    const vector<symreloc_t>& refs = symrelocs[symno];
+    for(unsigned b=0; b<refs.size(); ++b)
     {
-        if(R.R16.Relocs[a].second != symno) continue;
-        unsigned addr = R.R16.Relocs[a].first - base;
-        unsigned oldvalue = space[addr] | (space[addr+1] << 8);
-        unsigned newvalue = oldvalue + value;
+        const unsigned a = refs[b].second;
+        switch(refs[b].first)
+        {
+            case R16:
+            {
+                unsigned addr = R.R16.Relocs[a].first - base;
+                unsigned oldvalue = space[addr] | (space[addr+1] << 8);
+                unsigned newvalue = oldvalue + value;
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced %04X with %04X for sym %u\n", oldvalue,newvalue&65535, symno);
+                fprintf(stderr, "Replaced %04X with %04X for sym %u\n", oldvalue,newvalue&65535, symno);
 #endif
-        space[addr] = newvalue&255;
-        space[addr+1] = (newvalue>>8) & 255;
-    }
-    for(unsigned a=0; a<R.R16lo.Relocs.size(); ++a)
-    {
-        if(R.R16lo.Relocs[a].second != symno) continue;
-        unsigned addr = R.R16lo.Relocs[a].first - base;
-        unsigned oldvalue = space[addr];
-        unsigned newvalue = oldvalue + value;
+                space[addr] = newvalue&255;
+                space[addr+1] = (newvalue>>8) & 255;
+                break;
+            }
+            case R16lo:
+            {
+                unsigned addr = R.R16lo.Relocs[a].first - base;
+                unsigned oldvalue = space[addr];
+                unsigned newvalue = oldvalue + value;
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced %02X with %02X for sym %u\n", oldvalue,newvalue&255, symno);
+                fprintf(stderr, "Replaced %02X with %02X for sym %u\n", oldvalue,newvalue&255, symno);
 #endif
-        space[addr] = newvalue & 255;
-    }
-    for(unsigned a=0; a<R.R16hi.Relocs.size(); ++a)
-    {
-        if(R.R16hi.Relocs[a].second != symno) continue;
-        unsigned addr = R.R16hi.Relocs[a].first.first - base;
-        unsigned oldvalue = (space[addr] << 8) | R.R16hi.Relocs[a].first.second;
-        unsigned newvalue = oldvalue + value;
+                space[addr] = newvalue & 255;
+                break;
+            }
+            case R16hi:
+            {
+                unsigned addr = R.R16hi.Relocs[a].first.first - base;
+                unsigned oldvalue = (space[addr] << 8) | R.R16hi.Relocs[a].first.second;
+                unsigned newvalue = oldvalue + value;
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced %02X with %02X for sym %u\n",
-            space[addr],(newvalue>>8)&255, symno);
+                fprintf(stderr, "Replaced %02X with %02X for sym %u\n",
+                    space[addr],(newvalue>>8)&255, symno);
 #endif
-        space[addr] = (newvalue>>8) & 255;
-    }
-    for(unsigned a=0; a<R.R24.Relocs.size(); ++a)
-    {
-        if(R.R24.Relocs[a].second != symno) continue;
-        unsigned addr = R.R24.Relocs[a].first - base;
-        unsigned oldvalue = space[addr] | (space[addr+1] << 8) | (space[addr+2] << 16);
-        unsigned newvalue = oldvalue + value;
-        
+                space[addr] = (newvalue>>8) & 255;
+                break;
+            }
+            case R24:
+            {
+                unsigned addr = R.R24.Relocs[a].first - base;
+                unsigned oldvalue = space[addr] | (space[addr+1] << 8) | (space[addr+2] << 16);
+                unsigned newvalue = oldvalue + value;
+                
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced %06X with %06X for sym %u\n", oldvalue,newvalue, symno);
+                fprintf(stderr, "Replaced %06X with %06X for sym %u\n", oldvalue,newvalue, symno);
 #endif
-        space[addr] = newvalue&255;
-        space[addr+1] = (newvalue>>8) & 255;
-        space[addr+2] = (newvalue>>16) & 255;
-    }
-    for(unsigned a=0; a<R.R24seg.Relocs.size(); ++a)
-    {
-        if(R.R24seg.Relocs[a].second != symno) continue;
-        unsigned addr = R.R24seg.Relocs[a].first.first - base;
-        unsigned oldvalue = (space[addr] << 16) | R.R24seg.Relocs[a].first.second;
-        unsigned newvalue = oldvalue + value;
-        
+                space[addr] = newvalue&255;
+                space[addr+1] = (newvalue>>8) & 255;
+                space[addr+2] = (newvalue>>16) & 255;
+                break;
+            }
+            case R24seg:
+            {
+                unsigned addr = R.R24seg.Relocs[a].first.first - base;
+                unsigned oldvalue = (space[addr] << 16) | R.R24seg.Relocs[a].first.second;
+                unsigned newvalue = oldvalue + value;
+                
 #if DEBUG_FIXUPS
-        fprintf(stderr, "Replaced %02X with %02X for sym %u\n", space[addr],newvalue>>16, symno);
+                fprintf(stderr, "Replaced %02X with %02X for sym %u\n", space[addr],newvalue>>16, symno);
 #endif
-        space[addr] = (newvalue>>16) & 255;
+                space[addr] = (newvalue>>16) & 255;
+                break;
+            }
+        }
     }
 }
 
@@ -506,9 +800,10 @@ const vector<unsigned char>& O65::GetSeg(SegmentSelection seg) const
 {
     if(const Segment*const *s = GetSegRef(seg))
     {
-        return (*s)->space;
+        return (*s)->space.GetVector();
     }
-    return code->space;
+    static const vector<unsigned char> empty;
+    return empty;
 }
 
 unsigned O65::GetSegSize(SegmentSelection seg) const
@@ -524,13 +819,13 @@ unsigned O65::GetSymAddress(SegmentSelection seg, const std::string& name) const
 {
     if(const Segment*const *s = GetSegRef(seg))
     {
-        Segment::publicmap_t::const_iterator i = (*s)->publics.find(name);
-        if(i == code->publics.end())
+        unsigned n = (*s)->pubnames.Find(name);
+        if(n == ~0U)
         {
             fprintf(stderr, "Attempt to find symbol %s which not exists.\n", name.c_str());
             return 0;
         }
-        return i->second;
+        return (*s)->pubaddrs[n];
     }
     return 0;
 }
@@ -539,8 +834,7 @@ bool O65::HasSym(SegmentSelection seg, const std::string& name) const
 {
     if(const Segment*const *s = GetSegRef(seg))
     {
-        const O65::Segment::publicmap_t& pubs = (*s)->publics;
-        return pubs.find(name) != pubs.end();
+        return (*s)->pubnames.Find(name) != ~0U;
     }
     return false;
 }
@@ -550,15 +844,11 @@ const vector<std::string> O65::GetSymbolList(SegmentSelection seg) const
     vector<std::string> result;
     if(const Segment*const *s = GetSegRef(seg))
     {
-        const O65::Segment::publicmap_t& pubs = (*s)->publics;
+        const NameTable& pubs = (*s)->pubnames;
         result.reserve(pubs.size());
-        for(O65::Segment::publicmap_t::const_iterator
-            i = pubs.begin();
-            i != pubs.end();
-            ++i)
-        {
-            result.push_back(i->first);
-        }
+        for(unsigned a=0; a<pubs.size(); ++a)
+            result.push_back(pubs[a]);
+        std::sort(result.begin(), result.end());
     }
     return result;
 }
@@ -585,6 +875,7 @@ O65::Segment** O65::GetSegRef(SegmentSelection seg)
         default: return NULL;
     }
     if(!*result) *result = new Segment;
+    Segment::Unshare(*result);
     return result;
 }
 const O65::Segment*const * O65::GetSegRef(SegmentSelection seg) const
@@ -648,7 +939,7 @@ void O65::DeclareByteRelocation(SegmentSelection seg, const std::string& name, u
         (*s)->space[addr] = value & 0xFF;
         return;
     }
-    (*s)->R.R16lo.AddReloc(addr, symno);
+    (*s)->AddReloc((*s)->R.R16lo, Segment::R16lo, addr, symno);
 }
 
 void O65::DeclareWordRelocation(SegmentSelection seg, const std::string& name, unsigned addr)
@@ -667,7 +958,7 @@ void O65::DeclareWordRelocation(SegmentSelection seg, const std::string& name, u
         (*s)->space[addr + 1] = (value >> 8) & 0xFF;
         return;
     }
-    (*s)->R.R16.AddReloc(addr, symno);
+    (*s)->AddReloc((*s)->R.R16, Segment::R16, addr, symno);
 }
 
 void O65::DeclareLongRelocation(SegmentSelection seg, const std::string& name, unsigned addr)
@@ -687,61 +978,89 @@ void O65::DeclareLongRelocation(SegmentSelection seg, const std::string& name, u
         (*s)->space[addr + 2] = (value >>16) & 0xFF;
         return;
     }
-    (*s)->R.R24.AddReloc(addr, symno);
+    (*s)->AddReloc((*s)->R.R24, Segment::R24, addr, symno);
 }
 
-void O65::Segment::LoadRelocations(FILE* fp)
+bool O65::Segment::LoadRelocations(O65reader& reader, unsigned num_und,
+                                   std::string& messages)
 {
+    char Buf[128];
     int addr = -1;
     for(;;)
     {
-        int c = fgetc(fp);
-        if(!c || c == EOF)break;
+        unsigned c = reader.Byte();
+        if(!c || !reader.Ok()) break;
         if(c == 255) { addr += 254; continue; }
         addr += c;
-        c = fgetc(fp);
+        c = reader.Byte();
         unsigned type = c & 0xE0;
         unsigned area = c & 0x07;
-        
+
+        /* The patched bytes must be within the segment */
+        unsigned width = 0;
+        switch(type)
+        {
+            case 0x20: case 0x40: case 0xA0: width = 1; break;
+            case 0x80: width = 2; break;
+            case 0xC0: width = 3; break;
+        }
+        if(addr < 0 || (unsigned)addr + width > space.size())
+        {
+            std::sprintf(Buf,
+                "Error: Reloc at offset %d goes beyond the segment (%u bytes)\n",
+                addr, space.size());
+            messages += Buf;
+            return false;
+        }
+
         switch(area)
         {
             case 0: // external
             {
-                unsigned symno = LoadWord(fp);
+                unsigned symno = reader.Word();
+                if(symno >= num_und)
+                {
+                    std::sprintf(Buf,
+                        "Error: Reloc refers to undefined symbol %u of %u\n",
+                        symno, num_und);
+                    messages += Buf;
+                    return false;
+                }
                 switch(type)
                 {
                     case 0x20:
                     {
-                        R.R16lo.AddReloc(addr, symno);
+                        AddReloc(R.R16lo, R16lo, addr, symno);
                         break;
                     }
                     case 0x40:
                     {
-                        RT::R16hi_t::Type tmp(addr, fgetc(fp));
-                        R.R16hi.AddReloc(tmp, symno);
+                        RT::R16hi_t::Type tmp(addr, reader.Byte());
+                        AddReloc(R.R16hi, R16hi, tmp, symno);
                         break;
                     }
                     case 0x80:
                     {
-                        R.R16.AddReloc(addr, symno);
+                        AddReloc(R.R16, R16, addr, symno);
                         break;
                     }
                     case 0xA0:
                     {
-                        RT::R24seg_t::Type tmp(addr, LoadWord(fp));
-                        R.R24seg.AddReloc(tmp, symno);
+                        RT::R24seg_t::Type tmp(addr, reader.Word());
+                        AddReloc(R.R24seg, R24seg, tmp, symno);
                         break;
                     }
                     case 0xC0:
                     {
-                        R.R24.AddReloc(addr, symno);
+                        AddReloc(R.R24, R24, addr, symno);
                         break;
                     }
                     default:
                     {
-                        fprintf(stderr,
+                        std::sprintf(Buf,
                             "Error: External reloc type %02X not supported yet\n",
                             type);
+                        messages += Buf;
                     }
                 }
                 break;
@@ -762,7 +1081,7 @@ void O65::Segment::LoadRelocations(FILE* fp)
                     }
                     case 0x40:
                     {
-                        RT::R16hi_t::Type tmp(addr, fgetc(fp));
+                        RT::R16hi_t::Type tmp(addr, reader.Byte());
                         R.R16hi.AddFixup(seg, tmp);
                         break;
                     }
@@ -773,7 +1092,7 @@ void O65::Segment::LoadRelocations(FILE* fp)
                     }
                     case 0xA0:
                     {
-                        RT::R24seg_t::Type tmp(addr, LoadWord(fp));
+                        RT::R24seg_t::Type tmp(addr, reader.Word());
                         R.R24seg.AddFixup(seg, tmp);
                         break;
                     }
@@ -784,21 +1103,24 @@ void O65::Segment::LoadRelocations(FILE* fp)
                     }
                     default:
                     {
-                        fprintf(stderr,
+                        std::sprintf(Buf,
                             "Error: Fixup type %02X not supported yet\n",
                             type);
+                        messages += Buf;
                     }
                 }
                 break;
             }
             default:
             {
-                fprintf(stderr,
+                std::sprintf(Buf,
                     "Error: Reloc area type %02X not supported yet\n",
                         area);
+                messages += Buf;
             }
         }
     }
+    return reader.Ok();
 }
 
 const vector<pair<unsigned char, std::string> >& O65::GetCustomHeaders() const
@@ -814,6 +1136,21 @@ const Relocdata<unsigned> O65::GetRelocData(SegmentSelection seg) const
     return (*s)->R;
 }
 
+const vector<pair<unsigned, std::string> > O65::GetLongReferences(SegmentSelection seg) const
+{
+    vector<pair<unsigned, std::string> > result;
+    const Segment*const *s = GetSegRef(seg);
+    if(!s) return result;
+    
+    const Segment& segment = **s;
+    const Segment::RT::R24_t::RelocList& relocs = segment.R.R24.Relocs;
+    result.reserve(relocs.size());
+    for(unsigned a=0; a<relocs.size(); ++a)
+        result.push_back(make_pair(relocs[a].first - segment.base,
+                                   defs->GetName(relocs[a].second)));
+    return result;
+}
+
 const std::string GetSegmentName(const SegmentSelection seg)
 {
     switch(seg)
@@ -33,7 +33,6 @@ using std::pair;
  * Defects:
  *
  *    Only the TEXT segment is handled.
- *    File validity is not checked carefully.
  *    Undefined symbols may only be defined once.
  *
  */
@@ -59,11 +58,22 @@ public:
     ~O65();
     
     // Copy constructor, assignment operator
+    // Copies share the segment contents until modified.
     O65(const O65 &);
     const O65& operator= (const O65 &);
     
-    /*! Loads an object file from the specified file */
-    void Load(FILE *fp);
+    /*! Exchanges the contents of two objects. This is cheap. */
+    void swap(O65& b);
+    
+    /*! Loads an object file from the specified file. */
+    /*! Returns false if it is not a valid o65 file. */
+    bool Load(FILE *fp);
+    bool Load(class MappedFile* file);
+    
+    /*! The same, but the problems found are added to messages */
+    /*! instead of being printed, so that they can be shown later. */
+    bool Load(FILE *fp, std::string& messages);
+    bool Load(class MappedFile* file, std::string& messages);
     
     /*! Relocate the given segment to new address */
     void Locate(SegmentSelection seg, unsigned newaddress);
@@ -75,6 +85,11 @@ public:
     /*! The symbol must have been accessed in order to be defined. */
     void LinkSym(const std::string& name, unsigned value);
     
+    /*! Stops sharing the contents with copies and with the file. */
+    /*! After this, changing the object changes nothing that other */
+    /*! objects use, so different objects may be changed in parallel. */
+    void Detach();
+    
     /*! Declares a global label in the selected segment */
     void DeclareGlobal(SegmentSelection seg, const std::string& name, unsigned address);
     
@@ -120,10 +135,16 @@ public:
     
     /*! Get relocation data of the given segment */
     const Relocdata<unsigned> GetRelocData(SegmentSelection seg) const;
+    
+    /*! Returns the 24-bit references to symbols in the segment: */
+    /*! where each is, from the start of the segment, and the name. */
+    const vector<pair<unsigned, std::string> > GetLongReferences(SegmentSelection seg) const;
 
 private:
+    class NameTable;
     class Defs;
     class Segment;
+    class SegmentSpace;
     
     vector<pair<unsigned char, std::string> > customheaders;
     
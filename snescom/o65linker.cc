@@ -1,9 +1,11 @@
 #include "o65linker.hh"
 #include "msginsert.hh"
+#include "threadpool.hh"
 
 #include <list>
 #include <utility>
 #include <map>
+#include <algorithm>
 
 using std::make_pair;
 using std::list;
@@ -29,13 +31,14 @@ private:
     LinkageWish linkageBSS;
     
 public:
-    Object(const O65& obj, const string& what,
+    /* Takes over the contents of obj */
+    Object(O65& obj, const string& what,
         LinkageWish linkCODE,
         LinkageWish linkDATA = LinkageWish(),
         LinkageWish linkZERO = LinkageWish(),
         LinkageWish linkBSS = LinkageWish()
       )
-    : object(obj),
+    : object(),
       name(what),
       extlist(obj.GetExternList()),
       linkageCODE(linkCODE),
@@ -43,6 +46,7 @@ public:
       linkageZERO(linkZERO),
       linkageBSS(linkBSS)
     {
+        object.swap(obj);
     }
     
     Object()
@@ -58,9 +62,12 @@ public:
     
     const string& GetName() const { return name; }
     
+    /* Frees the contents; the name and linkage stay */
     void Release()
     {
-        //*this = Object();
+        O65 empty;
+        object.swap(empty);
+        vector<string>().swap(extlist);
     }
     
     bool operator< (const Object& b) const
@@ -107,20 +114,29 @@ typedef std::list<ClashItem> clashlist_t;
 
 class O65linker::SymCache
 {
-    typedef hash_map<string, ResolvedSymbol> cachetype;
+    typedef StringHashMap<ResolvedSymbol> cachetype;
     
     cachetype sym_cache;
 public:
+    /* Adds the symbols of the object. If any of them clashes,
+     * nothing is added and the clashes are listed.
+     */
     void Update(const Object& o, unsigned objnum,
                 clashlist_t& clashlist)
     {
-        Update(o, objnum, CODE, clashlist);
-        Update(o, objnum, DATA, clashlist);
-        Update(o, objnum, ZERO, clashlist);
-        Update(o, objnum, BSS,  clashlist);
+        vector<string> added;
+        Update(o, objnum, CODE, clashlist, added);
+        Update(o, objnum, DATA, clashlist, added);
+        Update(o, objnum, ZERO, clashlist, added);
+        Update(o, objnum, BSS,  clashlist, added);
+        
+        if(!clashlist.empty())
+            for(unsigned a=0; a<added.size(); ++a)
+                sym_cache.erase(added[a]);
     }
+private:
     void Update(const Object& o, unsigned objnum, SegmentSelection seg,
-                clashlist_t& clashlist)
+                clashlist_t& clashlist, vector<string>& added)
     {
         ResolvedSymbol res;
         res.objnum = objnum;
@@ -140,8 +156,12 @@ public:
                 continue;
             }
             sym_cache[symlist[a]] = res;
+            added.push_back(symlist[a]);
         }
     }
+public:
+    
+    const HashStats GetStats() const { return sym_cache.GetStats(); }
     
     const pair<ResolvedSymbol, bool> Find(const string& sym) const
     {
@@ -154,7 +174,24 @@ public:
     }
 };
 
-void O65linker::AddObject(const O65& object, const string& what,
+/* Where the symbols given with DefineSymbol() are */
+class O65linker::PendingIndex
+{
+public:
+    typedef StringHashMap<unsigned> definemap_t;
+    
+    definemap_t defines;  // name -> index in O65linker::defines
+    
+    PendingIndex(): defines() { }
+    
+    unsigned FindDefine(const string& name) const
+    {
+        definemap_t::const_iterator i = defines.find(name);
+        return i == defines.end() ? ~0U : i->second;
+    }
+};
+
+void O65linker::AddObject(O65& object, const string& what,
     LinkageWish linkageCODE)
 {
     LinkageWish linkageDATA;
@@ -169,7 +206,6 @@ void O65linker::AddObject(const O65& object, const string& what,
         return;
     }
     
-    SymCache backup = *symcache;
     Object *newobj = new Object(object, what,
         linkageCODE, linkageDATA, linkageZERO, linkageBSS);
     
@@ -192,14 +228,13 @@ void O65linker::AddObject(const O65& object, const string& what,
                 GetSegmentName(clash.found.seg).c_str()
             );
         }
-        *symcache = backup;
         delete newobj;
         return;
     }
     objects.push_back(newobj);
 }
 
-void O65linker::AddObject(const O65& object, const string& what, unsigned address)
+void O65linker::AddObject(O65& object, const string& what, unsigned address)
 {
     LinkageWish wish;
     wish.SetAddress(address);
@@ -247,6 +282,12 @@ void O65linker::PutAddrList(const vector<unsigned>& addrs, const SegmentSelectio
     }
 }
 
+void O65linker::PutAddr(unsigned objno, unsigned addr, const SegmentSelection seg)
+{
+    objects[objno]->GetLinkage(seg).SetAddress(addr);
+    objects[objno]->object.Locate(seg, addr);
+}
+
 const vector<unsigned char>& O65linker::GetSeg(const SegmentSelection seg, unsigned objno) const
 {
     return objects[objno]->object.GetSeg(seg);
@@ -257,6 +298,24 @@ const string& O65linker::GetName(unsigned objno) const
     return objects[objno]->GetName();
 }
 
+const vector<pair<string, unsigned> >
+    O65linker::GetSymbols(unsigned objno, const SegmentSelection seg) const
+{
+    const O65& o = objects[objno]->object;
+    const vector<string> names = o.GetSymbolList(seg);
+    
+    vector<pair<string, unsigned> > result;
+    result.reserve(names.size());
+    for(unsigned a=0; a<names.size(); ++a)
+        result.push_back(make_pair(names[a], o.GetSymAddress(seg, names[a])));
+    return result;
+}
+
+const HashStats O65linker::GetSymbolStats() const
+{
+    return symcache->GetStats();
+}
+
 void O65linker::Release(unsigned objno)
 {
     objects[objno]->Release();
@@ -268,21 +327,20 @@ void O65linker::DefineSymbol(const string& name, unsigned value)
     {
         fprintf(stderr, "O65 linker: Attempt to add symbols after linking\n");
     }
-    for(unsigned c=0; c<defines.size(); ++c)
+    unsigned c = pending->FindDefine(name);
+    if(c != ~0U)
     {
-        if(defines[c].first == name)
+        if(defines[c].second.first != value)
         {
-            if(defines[c].second.first != value)
-            {
-                fprintf(stderr,
-                    "O65 linker: Error: %s previously defined as %X,"
-                    " can not redefine as %X\n",
-                        name.c_str(), defines[c].second.first, value);
-            }
-            return;
+            fprintf(stderr,
+                "O65 linker: Error: %s previously defined as %X,"
+                " can not redefine as %X\n",
+                    name.c_str(), defines[c].second.first, value);
         }
+        return;
     }
     
+    pending->defines[name] = (unsigned)defines.size();
     defines.push_back(std::make_pair(name, std::make_pair(value, false)));
 }
 
@@ -309,52 +367,95 @@ void O65linker::AddReference(const string& name, const ReferMethod& reference)
     referers.push_back(make_pair(reference, name));
 }
 
-void O65linker::LinkSymbol(const string& name, unsigned value)
+const vector<CallEdge> O65linker::GetCallGraph() const
 {
+    vector<CallEdge> result;
     for(unsigned a=0; a<objects.size(); ++a)
     {
-        Object& o = *objects[a];
-        for(unsigned b=0; b<o.extlist.size(); ++b)
-        {
-            /* If this module is referring to this symbol */
-            if(o.extlist[b] == name)
-            {
-                o.extlist.erase(o.extlist.begin() + b);
-                o.object.LinkSym(name, value);
-                --b;
-            }
-        }
-    }
-    for(unsigned a=0; a<referers.size(); ++a)
-    {
-        if(name == referers[a].second)
+        const O65& object = objects[a]->object;
+        const vector<unsigned char>& code = object.GetSeg(CODE);
+        const vector<pair<unsigned, string> > refs = object.GetLongReferences(CODE);
+        
+        /* By callee; the objects are few compared to the references */
+        map<unsigned, CallEdge> edges;
+        for(unsigned b=0; b<refs.size(); ++b)
         {
-            // resolved referer
-            FinishReference(referers[a].first, value, name);
-            referers.erase(referers.begin() + a);
-            --a;
+            const pair<ResolvedSymbol, bool> tmp = symcache->Find(refs[b].second);
+            if(!tmp.second || tmp.first.seg != CODE || tmp.first.objnum == a) continue;
+            
+            CallEdge& edge = edges[tmp.first.objnum];
+            edge.from = a;
+            edge.to   = tmp.first.objnum;
+            ++edge.refs;
+            
+            unsigned pos = refs[b].first;
+            if(pos > 0 && pos <= code.size() && code[pos-1] == 0x22) // JSL
+                ++edge.calls;
         }
+        for(map<unsigned, CallEdge>::const_iterator i = edges.begin(); i != edges.end(); ++i)
+            result.push_back(i->second);
     }
+    return result;
 }
 
 void O65linker::FinishReference(const ReferMethod& reference, unsigned target, const string& what)
 {
-    unsigned pos = reference.GetAddr();
     unsigned value = reference.Evaluate(target);
     
-    char Buf[513];
-    sprintf(Buf, "%016X", value);
-
-    std::string title = "ref " + what + ": $" + (Buf + 16-reference.GetSize()*2);
-
-    vector<unsigned char> bytes;
+    patches.push_back(LinkPatch());
+    LinkPatch& patch = patches.back();
+    patch.address = reference.GetAddr();
+    patch.what    = what;
     for(unsigned n=0; n<reference.GetSize(); ++n)
     {
-        bytes.push_back(value & 255);
+        patch.bytes.push_back(value & 255);
         value >>= 8;
     }
+    patches_merged = false;
+}
+
+namespace
+{
+    bool PatchOrder(const LinkPatch& a, const LinkPatch& b)
+    {
+        return a.address < b.address;
+    }
+}
+
+const vector<LinkPatch>& O65linker::GetPatches()
+{
+    if(patches_merged) return patches;
     
-    AddLump(bytes, pos, title);
+    /* Sort by address, keeping the order of patches to the same address */
+    std::stable_sort(patches.begin(), patches.end(), PatchOrder);
+    
+    vector<LinkPatch> merged;
+    for(unsigned a=0; a<patches.size(); ++a)
+    {
+        const LinkPatch& patch = patches[a];
+        if(!merged.empty()
+        && merged.back().address + merged.back().bytes.size() == patch.address)
+        {
+            LinkPatch& prev = merged.back();
+            prev.bytes.insert(prev.bytes.end(), patch.bytes.begin(), patch.bytes.end());
+            prev.what += ", " + patch.what;
+            continue;
+        }
+        merged.push_back(patch);
+    }
+    patches.swap(merged);
+    patches_merged = true;
+    return patches;
+}
+
+const vector<pair<unsigned, unsigned> > O65linker::GetReferenceSites() const
+{
+    vector<pair<unsigned, unsigned> > result;
+    for(unsigned a=0; a<patches.size(); ++a)
+        result.push_back(make_pair(patches[a].address, (unsigned)patches[a].bytes.size()));
+    for(referlist_t::const_iterator i = referers.begin(); i != referers.end(); ++i)
+        result.push_back(make_pair(i->first.GetAddr(), i->first.GetSize()));
+    return result;
 }
 
 void O65linker::AddLump(const vector<unsigned char>& source,
@@ -383,7 +484,30 @@ void O65linker::AddLump(const vector<unsigned char>& source,
     AddObject(tmp, what);
 }
 
-void O65linker::Link()
+namespace
+{
+    /* The externs to link into each object */
+    typedef vector<pair<string, unsigned> > symlinks_t;
+    
+    template<typename ObjectPtr>
+    class Relocator
+    {
+        const vector<ObjectPtr>& objects;
+        const vector<symlinks_t>& symlinks;
+    public:
+        Relocator(const vector<ObjectPtr>& o, const vector<symlinks_t>& s)
+            : objects(o), symlinks(s) { }
+        
+        void operator() (unsigned objno) const
+        {
+            const symlinks_t& links = symlinks[objno];
+            for(unsigned a=0; a<links.size(); ++a)
+                objects[objno]->object.LinkSym(links[a].first, links[a].second);
+        }
+    };
+}
+
+void O65linker::Link(ThreadPool* pool)
 {
     if(linked)
     {
@@ -394,6 +518,13 @@ void O65linker::Link()
     
     MessageLinkingModules(objects.size());
 
+    /* First find the values of the externs of each module.
+     * This is done in order, so the messages come in order.
+     * Then the values are linked in; each module only touches
+     * its own data there, so the modules can be done in parallel.
+     */
+    vector<symlinks_t> symlinks(objects.size());
+    
     // For each module, satisfy each of their externs one by one.
     for(unsigned a=0; a<objects.size(); ++a)
     {
@@ -432,6 +563,7 @@ void O65linker::Link()
         
         MessageLoadingItem(o.GetName());
         
+        vector<string> unresolved;
         for(unsigned b=0; b<o.extlist.size(); ++b)
         {
             const string& ext = o.extlist[b];
@@ -446,14 +578,12 @@ void O65linker::Link()
             }
             
             // Or if it was an external definition.
-            for(unsigned c=0; c<defines.size(); ++c)
+            unsigned c = pending->FindDefine(ext);
+            if(c != ~0U)
             {
-                if(defines[c].first == ext)
-                {
-                    addr = defines[c].second.first;
-                    defines[c].second.second = true;
-                    ++defcount;
-                }
+                addr = defines[c].second.first;
+                defines[c].second.second = true;
+                ++defcount;
             }
             
             if(found == 0 && !defcount)
@@ -474,23 +604,31 @@ void O65linker::Link()
 */
             
             if(found > 0 || defcount > 0)
-            {
-                o.object.LinkSym(ext, addr);
-                
-                o.extlist.erase(o.extlist.begin() + b);
-                --b;
-            }
+                symlinks[a].push_back(make_pair(ext, addr));
+            else
+                unresolved.push_back(ext);
         }
+        o.extlist.swap(unresolved);
         if(!o.extlist.empty())
         {
             MessageUndefinedSymbols(o.extlist.size());
             // FIXME: where?
         }
+        
+        if(!symlinks[a].empty()) o.object.Detach();
     }
-
-    for(unsigned c=0; c<referers.size(); ++c)
+    
+    Relocator<Object*> relocator(objects, symlinks);
+    if(pool)
+        pool->RunEach(relocator, (unsigned)objects.size());
+    else
+        for(unsigned a=0; a<objects.size(); ++a)
+            relocator(a);
+
+    for(referlist_t::iterator next, c = referers.begin(); c != referers.end(); c = next)
     {
-        const string& name = referers[c].second;
+        next = c; ++next;
+        const string& name = c->second;
         const pair<ResolvedSymbol, bool> tmp = symcache->Find(name);
         if(tmp.second)
         {
@@ -500,9 +638,8 @@ void O65linker::Link()
             unsigned value = o.object.GetSymAddress(tmp.first.seg, name);
              
             // resolved referer
-            FinishReference(referers[c].first, value, name);
-            referers.erase(referers.begin() + c);
-            --c;
+            FinishReference(c->first, value, name);
+            referers.erase(c);
         }
     }
     
@@ -515,10 +652,10 @@ void O65linker::Link()
     {
         //fprintf(stderr,
         //    "O65 linker: Leftover references found.\n");
-        for(unsigned a=0; a<referers.size(); ++a)
+        for(referlist_t::const_iterator a = referers.begin(); a != referers.end(); ++a)
             fprintf(stderr,
                 "O65 linker: Unresolved reference: %s\n",
-                    referers[a].second.c_str());
+                    a->second.c_str());
     }
 
     for(unsigned c=0; c<defines.size(); ++c)
@@ -532,9 +669,12 @@ void O65linker::Link()
 
 O65linker::O65linker()
    : symcache(new SymCache),
+     pending(new PendingIndex),
      objects(),
      defines(),
      referers(),
+     patches(),
+     patches_merged(true),
      num_groups_used(0),
      linked(false)
 {
@@ -543,6 +683,7 @@ O65linker::O65linker()
 O65linker::~O65linker()
 {
     delete symcache;
+    delete pending;
 }
 
 namespace
@@ -592,6 +733,23 @@ namespace
 
 void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
                             unsigned long (*AddressTransformer)(unsigned long))
+{
+    LinkInput input;
+    ParseIPSfile(fp, what, input, AddressTransformer);
+    AddInput(input);
+}
+
+void O65linker::AddInput(LinkInput& input)
+{
+    for(list<LinkInput::Item>::iterator
+        i = input.items.begin(); i != input.items.end(); ++i)
+    {
+        AddObject(i->object, i->name, i->linkage);
+    }
+}
+
+void O65linker::ParseIPSfile(FILE* fp, const std::string& what, LinkInput& input,
+                             unsigned long (*AddressTransformer)(unsigned long))
 {
     rewind(fp);
     
@@ -679,7 +837,8 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
         next_lump = i; ++next_lump;
         const IPS_lump& lump = *i;
         
-        O65 tmp;
+        input.items.push_back(LinkInput::Item());
+        O65& tmp = input.items.back().object;
         
         tmp.LoadSegFrom(CODE, lump.data);
         tmp.Locate(CODE, lump.addr);
@@ -728,12 +887,10 @@ void O65linker::LoadIPSfile(FILE* fp, const std::string& what,
         char Buf[64];
         sprintf(Buf, "block $%06X of ", lump.addr);
         
-        LinkageWish wish;
-        wish.SetAddress(lump.addr);
-        
         //fprintf(stderr, "%s\n", Buf);
         
-        AddObject(tmp, Buf + what, wish);
+        input.items.back().name = Buf + what;
+        input.items.back().linkage.SetAddress(lump.addr);
     }
 }
 
@@ -2,6 +2,7 @@
 #define bqtO65linkerHH
 
 #include <vector>
+#include <list>
 #include <utility>
 #include <cstdio>
 #include <string>
@@ -12,6 +13,8 @@ using std::FILE;
 #include "o65.hh"
 #include "refer.hh"
 
+class ThreadPool;
+
 #define IPS_ADDRESS_EXTERN 0x01
 #define IPS_ADDRESS_GLOBAL 0x02
 #define IPS_EOF_MARKER     0x454F46
@@ -26,8 +29,15 @@ struct LinkageWish
         LinkThisPage
     } type;
     unsigned param;
+    
+    /* These go with any type but LinkHere. 0 = no constraint. */
+    unsigned align;   // the address must be a multiple of this
+    unsigned nocross; // the object must not cross a multiple of this
+    
+    /* Often run code, that should be called through the FastROM mirror */
+    bool hot;
 public:
-    LinkageWish(): type(LinkAnywhere), param(0) {}
+    LinkageWish(): type(LinkAnywhere), param(0), align(0), nocross(0), hot(false) {}
     
     unsigned GetAddress() const
     {
@@ -40,12 +50,65 @@ public:
     void SetAddress(unsigned addr) { param=addr; type=LinkHere; }
     void SetLinkageGroup(unsigned num) { param=num; type=LinkInGroup; }
     void SetLinkagePage(unsigned page) { param=page; type=LinkThisPage; }
+    void SetAlignment(unsigned n) { align=n; }
+    void SetNoCross(unsigned n) { nocross=n; }
+    void SetHot() { hot=true; }
     
-    bool operator< (const LinkageWish& b) const { return type==b.type ? param<b.param : type<b.type; }
-    bool operator==(const LinkageWish& b) const { return type==b.type && param==b.param; }
+    bool operator< (const LinkageWish& b) const
+    {
+        if(type != b.type) return type < b.type;
+        if(param != b.param) return param < b.param;
+        if(align != b.align) return align < b.align;
+        if(nocross != b.nocross) return nocross < b.nocross;
+        return hot < b.hot;
+    }
+    bool operator==(const LinkageWish& b) const
+    {
+        return type==b.type && param==b.param
+            && align==b.align && nocross==b.nocross && hot==b.hot;
+    }
     inline bool operator!=(const LinkageWish& b) const { return !operator==(b); }
 };
 
+/* Objects read from an input file, not yet given to a linker.
+ * Reading them touches no linker state, so several files
+ * can be read at the same time.
+ */
+struct LinkInput
+{
+    struct Item
+    {
+        O65         object;
+        std::string name;
+        LinkageWish linkage;
+    };
+    std::list<Item> items;
+};
+
+/* Bytes to be written over the linked output,
+ * from references resolved by the linker.
+ */
+struct LinkPatch
+{
+    unsigned address;
+    std::vector<unsigned char> bytes;
+    std::string what; /* names of the symbols referred to */
+    
+    LinkPatch(): address(0), bytes(), what() { }
+};
+
+/* The 24-bit references from the code of one object
+ * to the code of another.
+ */
+struct CallEdge
+{
+    unsigned from, to; /* object numbers */
+    unsigned refs;     /* number of references */
+    unsigned calls;    /* how many of them are JSLs */
+    
+    CallEdge(): from(0), to(0), refs(0), calls(0) { }
+};
+
 class O65linker
 {
 public:
@@ -55,10 +118,18 @@ public:
     void LoadIPSfile(FILE* fp, const std::string& what,
                      unsigned long (*AddressTransformer)(unsigned long) = 0);
     
-    void AddObject(const O65& object, const std::string& what,
+    /* Reads the IPS file into input. */
+    static void ParseIPSfile(FILE* fp, const std::string& what, LinkInput& input,
+                             unsigned long (*AddressTransformer)(unsigned long) = 0);
+    
+    /* Adds the objects of input, in order. They are taken over. */
+    void AddInput(LinkInput& input);
+    
+    /* The linker takes over the contents of object; it is left empty. */
+    void AddObject(O65& object, const std::string& what,
         LinkageWish linkageCODE = LinkageWish());
     
-    void AddObject(const O65& object, const std::string& what, unsigned address);
+    void AddObject(O65& object, const std::string& what, unsigned address);
     void AddLump(const std::vector<unsigned char>&,
                  unsigned address,
                  const std::string& what, const std::string& name="");
@@ -71,6 +142,9 @@ public:
     const std::vector<unsigned> GetAddrList(const SegmentSelection seg=CODE) const;
     const std::vector<LinkageWish> GetLinkageList(const SegmentSelection seg=CODE) const;
     void PutAddrList(const std::vector<unsigned>& addrs, const SegmentSelection seg=CODE);
+    void PutAddr(unsigned objno, unsigned addr, const SegmentSelection seg=CODE);
+    
+    unsigned GetObjectCount() const { return (unsigned)objects.size(); }
     
     const std::vector<unsigned char>& GetSeg(const SegmentSelection seg, unsigned objno) const;
 
@@ -79,15 +153,37 @@ public:
     
     const std::string& GetName(unsigned objno) const;
     
+    /* The globals of the object, with their addresses */
+    const std::vector<pair<std::string, unsigned> >
+        GetSymbols(unsigned objno, const SegmentSelection seg=CODE) const;
+    
     void DefineSymbol(const std::string& name, unsigned value);
     
     void AddReference(const std::string& name, const ReferMethod& reference);
+    
+    /* The long references between the objects' code, by caller
+     * and callee. They are gone after Link(), so ask before it.
+     */
+    const std::vector<CallEdge> GetCallGraph() const;
 
-    void Link();
+    /* If a pool is given, the objects are relocated in parallel. */
+    void Link(ThreadPool* pool = NULL);
+    
+    /* How the table of global symbols is doing, for --stats */
+    const struct HashStats GetSymbolStats() const;
+    
+    /* The patches, by address. Adjacent ones are merged. */
+    const std::vector<LinkPatch>& GetPatches();
+    
+    /* Where the references will be patched in, resolved or not,
+     * as (address, size). Nothing may be linked over them.
+     */
+    const std::vector<pair<unsigned, unsigned> > GetReferenceSites() const;
     
     void SortByAddress();
     
-    // Release the memory allocated by given obj
+    // Release the memory allocated by given obj.
+    // Its segments become empty; the name and addresses stay.
     void Release(unsigned objno); // no range checks
 
 private:
@@ -96,19 +192,23 @@ private:
     const O65linker& operator= (const O65linker& );
 
 private:
-    void LinkSymbol(const std::string& name, unsigned value);
-    
     void FinishReference(const ReferMethod& reference, unsigned target,
                          const std::string& what);
 
     class SymCache;
     class Object;
+    class PendingIndex;
     
     SymCache *symcache;
+    PendingIndex *pending;
+    
+    typedef std::list<pair<ReferMethod, std::string> > referlist_t;
     
     std::vector<Object* > objects;
     std::vector<pair<std::string, pair<unsigned, bool> > > defines;
-    std::vector<pair<ReferMethod, std::string> > referers;
+    referlist_t referers;
+    std::vector<LinkPatch> patches;
+    bool patches_merged;
     unsigned num_groups_used;
     bool linked;
 };
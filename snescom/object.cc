@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <algorithm>
 #include <list>
 #include <map>
 #include <set>
@@ -8,6 +9,8 @@
 #include "object.hh"
 #include "relocdata.hh"
 #include "warning.hh"
+#include "bps.hh"
+#include "hash.hh"
 
 bool fix_jumps = false;
 
@@ -127,12 +130,17 @@ public:
     
     const std::vector<unsigned char> GetContent() const;
     const std::vector<unsigned char> GetContent(unsigned a,unsigned l) const;
+    void CopyContent(unsigned a,unsigned l, unsigned char* target) const;
     unsigned GetUtilization(unsigned begin, unsigned size) const;
 
     /// LABELS ///
 public:
-    typedef std::map<std::string, unsigned> LabelList;
+    typedef StringHashMap<unsigned> LabelList;
     typedef std::map<unsigned, LabelList> LabelMap;
+    
+    /* The labels of a level, sorted by name */
+    typedef std::vector<std::pair<std::string, unsigned> > SortedLabels;
+    static const SortedLabels SortLabels(const LabelList& labels);
 private:
     LabelMap labels;
 
@@ -154,6 +162,7 @@ public:
     void UndefineLabel(const std::string& name);
 
     void DumpLabels(const char *segname) const;
+    const HashStats GetLabelStats() const;
 
 
     /// GENERIC ///
@@ -219,29 +228,54 @@ const std::vector<unsigned char> Object::Segment::GetContent(unsigned a, unsigne
     return Data.GetContent(a, l);
 }
 
+void Object::Segment::CopyContent(unsigned a, unsigned l, unsigned char* target) const
+{
+    Data.CopyTo(a, l, target);
+}
+
 unsigned Object::Segment::GetUtilization(unsigned begin, unsigned size) const
 {
     return Data.GetUtilization(begin, size);
 }
 
+const Object::Segment::SortedLabels
+    Object::Segment::SortLabels(const LabelList& labels)
+{
+    SortedLabels result(labels.begin(), labels.end());
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+const HashStats Object::Segment::GetLabelStats() const
+{
+    HashStats result;
+    for(LabelMap::const_iterator i = labels.begin(); i != labels.end(); ++i)
+        result.Add(i->second.GetStats());
+    return result;
+}
+
 void Object::Segment::ClearLabels(unsigned level)
 {
     LabelList& level_labels = GetLabels(level);
     
+    /* Only the unused ones are sorted, for the order of the warnings */
+    std::vector<std::string> unused;
     for(LabelList::const_iterator
-        i = level_labels.begin(); i !=level_labels.end(); ++i)
+        i = level_labels.begin(); i != level_labels.end(); ++i)
     {
         if(UnusedLabels.find(i->first) != UnusedLabels.end())
         {
-            if(MayWarn("unused-label"))
-            {
-                std::fprintf(stderr,
-                    "Warning: Unused label '%s'\n",
-                        i->first.c_str());
-            }
+            unused.push_back(i->first);
             UnusedLabels.erase(i->first);
         }
     }
+    std::sort(unused.begin(), unused.end());
+    
+    if(MayWarn("unused-label"))
+        for(unsigned a=0; a<unused.size(); ++a)
+            std::fprintf(stderr,
+                "Warning: Unused label '%s'\n",
+                    unused[a].c_str());
     
     level_labels.clear();
 }
@@ -310,10 +344,11 @@ void Object::Segment::DumpLabels(const char *segname) const
         i != labels.end(); ++i)
     {
         // level -> labels
+        const SortedLabels sorted = SortLabels(i->second);
         
-        for(LabelList::const_iterator
-            j = i->second.begin();
-            j != i->second.end();
+        for(SortedLabels::const_iterator
+            j = sorted.begin();
+            j != sorted.end();
             ++j)
         {
             // name -> address
@@ -746,6 +781,11 @@ std::vector<unsigned char> Object::GetContent(unsigned begin, unsigned size) con
     return GetSeg().GetContent(begin, size);
 }
     
+void Object::CopyContent(unsigned begin, unsigned size, unsigned char* target) const
+{
+    GetSeg().CopyContent(begin, size, target);
+}
+
 unsigned Object::GetUtilization(unsigned begin, unsigned size) const
 {
     return GetSeg().GetUtilization(begin, size);
@@ -1045,16 +1085,18 @@ namespace
         unsigned count = 0;
         for(LabelMap::const_iterator i = labels.begin(); i != labels.end(); ++i)
         {
-            count += i->second.size();
+            count += (unsigned)i->second.size();
         }
         //PutWD(count, fp, use32);
         
         // Put labels
         for(LabelMap::const_iterator i = labels.begin(); i != labels.end(); ++i)
         {
-            for(Object::Segment::LabelList::const_iterator
-                j = i->second.begin();
-                j != i->second.end();
+            const Object::Segment::SortedLabels
+                sorted = Object::Segment::SortLabels(i->second);
+            for(Object::Segment::SortedLabels::const_iterator
+                j = sorted.begin();
+                j != sorted.end();
                 ++j)
             {
                 unsigned addr           = j->second;
@@ -1336,6 +1378,12 @@ void Object::WriteO65(std::FILE* fp)
         
         default: /* ignore */ break;
     }
+    if(Linkage.align)
+        PutCustomHeader(fp, 10, 3, Linkage.align);
+    if(Linkage.nocross)
+        PutCustomHeader(fp, 10, 4, Linkage.nocross);
+    if(Linkage.hot)
+        PutCustomHeader(fp, 10, 5, 1);
     
     PutCustomHeader(fp, 2, PROGNAME" "VERSION);
     
@@ -1404,6 +1452,47 @@ void Object::WriteRAW(std::FILE* fp, unsigned size, unsigned offset)
     }
 }
 
+void Object::WriteBPS(std::FILE* fp, const std::vector<unsigned char>& source)
+{
+    if(Linkage.type != LinkageWish::LinkAnywhere)
+    {
+        fprintf(stderr, "Warning: BPS file is never relocated - .link statement ignored.\n");
+    }
+    
+    const Segment& seg = *code;
+    if(!seg.R.R16.Relocs.empty()
+    || !seg.R.R16lo.Relocs.empty()
+    || !seg.R.R16hi.Relocs.empty()
+    || !seg.R.R24.Relocs.empty()
+    || !seg.R.R24seg.Relocs.empty())
+    {
+        fprintf(stderr, "Error: Externs aren't supported in BPS format.\n");
+        assembly_errors = true;
+    }
+    
+    /* The target is the source with our blobs written over it,
+     * at the same addresses an IPS file would use.
+     */
+    std::vector<unsigned char> target = source;
+    
+    unsigned addr = 0;
+    for(;;)
+    {
+        unsigned size;
+        addr = seg.FindNextBlob(addr, size);
+        if(!size) break;
+        
+        if(addr + size > target.size()) target.resize(addr + size);
+        
+        std::vector<unsigned char> data = seg.GetContent(addr, size);
+        std::copy(data.begin(), data.end(), target.begin() + addr);
+        
+        addr += size;
+    }
+    
+    ::WriteBPS(fp, source, target);
+}
+
 void Object::Dump()
 {
     DumpLabels();
@@ -1436,6 +1525,16 @@ void Object::AddLump(const std::vector<unsigned char>& lump)
 }
 
 
+const HashStats Object::GetLabelStats() const
+{
+    HashStats result;
+    result.Add(code->GetLabelStats());
+    result.Add(data->GetLabelStats());
+    result.Add(zero->GetLabelStats());
+    result.Add(bss->GetLabelStats());
+    return result;
+}
+
 void Object::DumpLabels() const
 {
     code->DumpLabels("TEXT");
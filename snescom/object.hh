@@ -33,11 +33,13 @@ public:
     void SelectDATA() { CurSegment = DATA; }
     void SelectZERO() { CurSegment = ZERO; }
     void SelectBSS() { CurSegment = BSS; }
+    void SelectSegment(SegmentSelection seg) { CurSegment = seg; }
     
     unsigned GetSegmentBase() const;
     unsigned GetSegmentSize() const;
     std::vector<unsigned char> GetContent() const;
     std::vector<unsigned char> GetContent(unsigned begin, unsigned size) const;
+    void CopyContent(unsigned begin, unsigned size, unsigned char* target) const;
 
     unsigned GetUtilization(unsigned begin, unsigned size) const;
     
@@ -48,6 +50,7 @@ public:
     void WriteO65(std::FILE* fp);
     void WriteIPS(std::FILE* fp);
     void WriteRAW(std::FILE* fp, unsigned size=0, unsigned offset=0);
+    void WriteBPS(std::FILE* fp, const std::vector<unsigned char>& source);
     
     // If a REL8 should be flipped at this position
     bool ShouldFlipHere() const;
@@ -62,6 +65,9 @@ public:
     bool FindLabel(const std::string& name, unsigned level,
                    SegmentSelection& seg, unsigned& result) const;
     
+    /* How the label tables are doing, for --stats */
+    const struct HashStats GetLabelStats() const;
+    
 public:
     class Segment;
 
@@ -44,6 +44,9 @@ public:
     /* Find the range that has this value */
     const_iterator find(const Key& lo) const;
     
+    /* Find the first range that overlaps lo..up */
+    const_iterator find_coinciding(const Key& lo, const Key& up) const;
+    
     /* Standard functions */
     const_iterator begin() const { return data.begin(); }
     const_iterator end() const { return data.end(); }
@@ -51,16 +54,16 @@ public:
     bool empty() const { return data.empty(); }
     void clear() { data.clear(); }
     
-#if 0
     template<typename Listtype>
     void find_all_coinciding(const Key& lo, const Key& up,
-                             Listtype& target);
-#endif
+                             Listtype& target) const;
     
-    /* Optimization function */
+    /* Optimization function: joins the ranges that touch */
     void compact();
     
     // default copy cons. and assign-op. are fine
+private:
+    iterator first_coinciding(const Key& lo, const Key& up);
 };
 
 #include "rangeset.tcc"
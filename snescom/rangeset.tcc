@@ -1,7 +1,35 @@
-#include <list>
-
 #include "rangeset.hh"
 
+/* The ranges never overlap, so they are sorted
+ * by their upper ends as well as by their lower ends.
+ */
+template<typename Key>
+typename rangeset<Key>::iterator
+    rangeset<Key>::first_coinciding(const Key& lo, const Key& up)
+{
+    if(!(lo < up)) return data.end();
+    
+    range key;
+    key.lower = lo;
+    key.upper = lo;
+    
+    /* The first range that begins at lo or later */
+    iterator a = data.lower_bound(key);
+    
+    /* The one before it may extend over lo */
+    if(a != data.begin())
+    {
+        iterator prev = a; --prev;
+        if(prev->upper > lo) return prev;
+    }
+    while(a != data.end() && a->lower < up)
+    {
+        if(a->upper > lo && a->lower < a->upper) return a;
+        ++a;
+    }
+    return data.end();
+}
+
 template<typename Key>
 void rangeset<Key>::erase(const Key& lo, const Key& up)
 {
@@ -9,39 +37,29 @@ void rangeset<Key>::erase(const Key& lo, const Key& up)
     newrange.lower = lo;
     newrange.upper = up;
     
-    typedef range tmpelem;
-    typedef std::list<tmpelem> tmplist;
-    tmplist newitems;
-    
-    /* FIXME: This is slower than it needs to be */
-    for(iterator b,a=data.begin(); a!=data.end(); a=b)
+    for(iterator a = first_coinciding(lo, up);
+        a != data.end() && a->lower < up; )
     {
-        b = a; ++b;
-        if(a->coincides(newrange))
+        if(!a->coincides(newrange)) { ++a; continue; }
+        
+        range old = *a;
+        data.erase(a++);
+        
+        /* The parts outside lo..up stay */
+        if(old.lower < lo)
         {
-            if(a->lower < lo)
-            {
-                range lowrange;
-                lowrange.lower = a->lower;
-                lowrange.upper = lo;
-                newitems.push_front(lowrange);
-            }
-            if(a->upper > up)
-            {
-                range uprange;
-                uprange.lower = up;
-                uprange.upper = a->upper;
-                newitems.push_front(uprange);
-            }
-            data.erase(a);
+            range lowrange;
+            lowrange.lower = old.lower;
+            lowrange.upper = lo;
+            data.insert(a, lowrange);
+        }
+        if(old.upper > up)
+        {
+            range uprange;
+            uprange.lower = up;
+            uprange.upper = old.upper;
+            data.insert(a, uprange);
         }
-    }
-    for(typename tmplist::const_iterator
-            i = newitems.begin();
-            i != newitems.end();
-            ++i)
-    {
-        data.insert(*i);
     }
 }
 
@@ -56,7 +74,6 @@ void rangeset<Key>::set(const Key& lo, const Key& up)
 {
     erase(lo, up);
     
-    /* FIXME: This is way slower than it needs to be */
     range newrange;
     newrange.lower = lo;
     newrange.upper = up;
@@ -69,25 +86,25 @@ void rangeset<Key>::insert(const Key& value)
     set(value, value+1);
 }
 
-
-
 template<typename Key>
 typename rangeset<Key>::const_iterator
     rangeset<Key>::find(const Key& v) const
 {
-    /* FIXME: Should use lower_bound, upper_bound or something */
-    
-    for(const_iterator a=data.begin(); a!=data.end(); ++a)
-        if(a->contains(v)) return a;
-    return data.end();
+    return find_coinciding(v, v+1);
+}
+
+template<typename Key>
+typename rangeset<Key>::const_iterator
+    rangeset<Key>::find_coinciding(const Key& lo, const Key& up) const
+{
+    return const_cast<rangeset&>(*this).first_coinciding(lo, up);
 }
 
-#if 0
 template<typename Key>
 template<typename Listtype>
 void rangeset<Key>::find_all_coinciding
    (const Key& lo, const Key& up,
-    Listtype& target)
+    Listtype& target) const
 {
     range newrange;
     newrange.lower = lo;
@@ -95,31 +112,25 @@ void rangeset<Key>::find_all_coinciding
     
     target.clear();
     
-    for(const_iterator a=data.begin(); a!=data.end(); ++a)
+    for(const_iterator a = find_coinciding(lo, up);
+        a != data.end() && a->lower < up; ++a)
         if(a->coincides(newrange))
             target.push_back(a);
 }
-#endif
 
 template<typename Key>
 void rangeset<Key>::compact()
 {
-Retry:
-    for(iterator b,a=data.begin(); a!=data.end(); a=b)
+    Cont result;
+    for(const_iterator a = data.begin(); a != data.end(); )
     {
-        b=a; ++b;
+        range merged = *a;
         
-        // If the next one is followup to this one
-        if(b->lower == a->upper)
-        {
-            range newrange;
-            newrange.lower = a->lower;
-            newrange.upper = b->upper;
-            
-            data.insert(newrange);
-            data.erase(a);
-            data.erase(b);
-            goto Retry;
-        }
+        // While the next one is followup to this one
+        for(++a; a != data.end() && a->lower == merged.upper; ++a)
+            merged.upper = a->upper;
+        
+        result.insert(result.end(), merged);
     }
+    data.swap(result);
 }
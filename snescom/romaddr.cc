@@ -1,6 +1,26 @@
 #include "romaddr.hh"
 #include <stdio.h>
 
+static bool FastROM = false;
+
+void SetFastROM(bool enable) { FastROM = enable; }
+bool IsFastROM() { return FastROM; }
+
+unsigned int FastROMaddr(unsigned int addr)
+{
+    /* Only the upper halves of banks 00..3F are ROM */
+    if(addr < 0x400000 && (addr & 0xFFFF) >= 0x8000)
+        return addr | 0x800000;
+    return addr;
+}
+
+unsigned int SlowROMaddr(unsigned int addr)
+{
+    if(addr >= 0x800000 && addr < 0xC00000 && (addr & 0xFFFF) >= 0x8000)
+        return addr & ~0x800000;
+    return addr;
+}
+
 unsigned char ROM2SNESpage(unsigned char page)
 {
     if(page < 0x40) return page | 0xC0;
@@ -8,7 +28,7 @@ unsigned char ROM2SNESpage(unsigned char page)
     /* Pages 00..3F have only their high part mirrored */
     /* Pages 7E..7F can not be used (they're RAM) */
     
-    if(page >= 0x7E) return page & 0x3F;
+    if(page >= 0x7E) return (page & 0x3F) | (FastROM ? 0x80 : 0);
     return (page - 0x40) + 0x40;
 }
 
@@ -31,6 +51,8 @@ static unsigned long SNES2ROMaddr_(unsigned int addr)
 unsigned int ROM2SNESaddr(unsigned int addr, int mode) {
     unsigned int retval = 0;
     
+    if (mode == 1 && FastROM) mode = 2;
+    
     if (mode == 1) {
         unsigned int bank_count = addr / 0x8000;
         unsigned int remainder = (addr % 0x8000) + 0x8000;
@@ -76,7 +98,6 @@ unsigned int SNES2ROMaddr(unsigned int addr)
         ret = bank * 0x8000 + (addr & 0x7FFF);
     }
     
-    printf("SNES %X -> ROM %X\n", addr, ret);
     return ret;
 }
 
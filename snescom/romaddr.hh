@@ -9,6 +9,22 @@ unsigned int ROM2SNESaddr(unsigned int addr, int mode);
 
 bool IsSNESbased(unsigned int addr);
 
+/* In FastROM mode, the ROM addresses made above are in the
+ * $80-$FF banks, where the ROM can be read at 3.58 MHz.
+ */
+void SetFastROM(bool enable);
+bool IsFastROM();
+
+/* The $80-$FF mirror of a ROM address in banks $00-$3F.
+ * Other addresses are returned unchanged.
+ */
+unsigned int FastROMaddr(unsigned int addr);
+
+/* The other way: the $00-$3F address of a ROM address
+ * in banks $80-$BF. Other addresses are returned unchanged.
+ */
+unsigned int SlowROMaddr(unsigned int addr);
+
 /* Returns true if the given ROM is probably a HiROM */
 bool GuessROMtype(const unsigned char* ROM, unsigned ROMsize);
 
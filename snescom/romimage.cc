@@ -0,0 +1,89 @@
+#include <unistd.h>
+
+#ifndef WIN32
+# include <sys/mman.h>
+# define USE_MMAP
+#endif
+
+#include "romimage.hh"
+
+ROMimage::ROMimage(std::FILE* f)
+    : fp(f), data(NULL), size(0), mapped(false), buffer()
+{
+}
+
+ROMimage::~ROMimage()
+{
+    Close();
+}
+
+void ROMimage::Unmap()
+{
+#ifdef USE_MMAP
+    if(mapped && size) munmap(data, size);
+#endif
+    mapped = false;
+    data   = NULL;
+}
+
+void ROMimage::SetSize(unsigned newsize)
+{
+    if(!fp) return;
+    
+#ifdef USE_MMAP
+    if(buffer.empty())
+    {
+        /* The stdio buffer must not be flushed on top of the mapping */
+        std::fflush(fp);
+        int fd = fileno(fp);
+        
+        Unmap();
+        size = 0;
+        
+        if(newsize == 0)
+        {
+            ftruncate(fd, 0);
+            mapped = true;
+            return;
+        }
+        if(ftruncate(fd, newsize) == 0)
+        {
+            void* ptr = mmap(NULL, newsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(ptr != MAP_FAILED)
+            {
+                data   = (unsigned char*)ptr;
+                size   = newsize;
+                mapped = true;
+                return;
+            }
+            ftruncate(fd, 0);
+        }
+        /* Not mappable (e.g. a pipe), so buffer it instead. */
+    }
+#endif
+    
+    buffer.resize(newsize);
+    size = newsize;
+    data = size ? &buffer[0] : NULL;
+}
+
+void ROMimage::Close()
+{
+    if(!fp) return;
+    
+    if(mapped)
+    {
+        Unmap();
+        std::fseek(fp, 0, SEEK_END);
+    }
+    else if(size)
+    {
+        std::fseek(fp, 0, SEEK_SET);
+        std::fwrite(data, 1, size, fp);
+    }
+    
+    buffer.clear();
+    data = NULL;
+    size = 0;
+    fp   = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef bqtRomImageHH
+#define bqtRomImageHH
+
+#include <cstdio>
+#include <vector>
+
+/* A ROM file being built in place.
+ *
+ * When the output is a regular file, it is resized to its final
+ * size and mapped to memory, so that the contents are written
+ * straight into the file and never copied around.
+ * Otherwise (pipes, systems without mmap) the image is kept
+ * in memory and written out by Close().
+ */
+class ROMimage
+{
+public:
+    explicit ROMimage(std::FILE* fp);
+    ~ROMimage();
+    
+    /* Sets the size of the image. The new bytes are zero. */
+    void SetSize(unsigned newsize);
+    unsigned GetSize() const { return size; }
+    
+    unsigned char* GetData() { return data; }
+    const unsigned char* GetData() const { return data; }
+    
+    unsigned char& operator[] (unsigned pos) { return data[pos]; }
+    unsigned char operator[] (unsigned pos) const { return data[pos]; }
+    
+    /* Finishes the file. Called by the destructor too. */
+    void Close();
+    
+private:
+    void Unmap();
+    
+    std::FILE* fp;
+    unsigned char* data;
+    unsigned size;
+    bool mapped;
+    std::vector<unsigned char> buffer;
+    
+private:
+    ROMimage(const ROMimage&);
+    void operator=(const ROMimage&);
+};
+
+#endif
@@ -1,13 +1,18 @@
 #include <cstdio>
+#include <algorithm>
 
 #include "space.hh"
 #include "logfiles.hh"
 #include "binpacker.hh"
 #include "romaddr.hh"
+#include "threadpool.hh"
 
 using namespace std;
 
-freespacemap::freespacemap() : quiet(false)
+freespacemap::freespacemap()
+    : quiet(false), pack_time_budget(0.0), pack_deadline(0.0),
+      pool(NULL), call_graph(NULL),
+      holes_by_size(), holes_by_page()
 {
 }
 
@@ -30,40 +35,12 @@ unsigned freespacemap::Find(unsigned page, unsigned length)
         }
         return NOWHERE;
     }
-    freespaceset &spaceset = mapi->second;
-    freespaceset::const_iterator reci;
-
-    unsigned bestscore = 0;
-    unsigned bestpos   = NOWHERE;
     
-    for(reci = spaceset.begin(); reci != spaceset.end(); ++reci)
-    {
-        const unsigned recpos = reci->lower;
-        const unsigned reclen = reci->upper - recpos;
-        
-        if(reclen == length)
-        {
-            bestpos = recpos;
-            // Found exact match!
-            break;
-        }
-        if(reclen < length)
-        {
-            // Too small, not good.
-            continue;
-        }
-        
-        // The smaller, the better.
-        unsigned score = 0x7FFFFFF - reclen;
-        
-        if(score > bestscore)
-        {
-            bestscore = score;
-            bestpos   = recpos;
-            //break;
-        }
-    }
-    if(!bestscore)
+    // The smallest hole that fits; the first one of them.
+    set<freespacehole, freespacehole::PageOrder>::const_iterator
+        best = holes_by_page.lower_bound(freespacehole(length, page, 0));
+    
+    if(best == holes_by_page.end() || best->page != page)
     {
         if(!quiet)
         {
@@ -79,7 +56,8 @@ unsigned freespacemap::Find(unsigned page, unsigned length)
         return NOWHERE;
     }
     
-    spaceset.erase(bestpos, bestpos+length);
+    unsigned bestpos = best->pos;
+    EraseRange(page, bestpos, bestpos+length);
     
     return bestpos;
 }
@@ -189,6 +167,16 @@ unsigned freespacemap::GetFragmentation(unsigned page) const
     return 0;
 }
 
+unsigned freespacemap::GetLargestHole(unsigned page) const
+{
+    /* The last hole of the page in this order is the largest */
+    set<freespacehole, freespacehole::PageOrder>::const_iterator
+        i = holes_by_page.lower_bound(freespacehole(0, page+1, 0));
+    if(i == holes_by_page.begin()) return 0;
+    --i;
+    return i->page == page ? i->len : 0;
+}
+
 const set<unsigned> freespacemap::GetPageList() const
 {
     set<unsigned> result;
@@ -211,8 +199,7 @@ void freespacemap::Add(unsigned page, unsigned begin, unsigned length)
             page,begin,length, GetPageSize());
     }
     
-    operator[] (page).set(begin, begin+length);
-    operator[] (page).compact();
+    SetRange(page, begin, begin+length);
 }
 void freespacemap::Add(unsigned longaddr, unsigned length)
 {
@@ -229,13 +216,9 @@ void freespacemap::Del(unsigned page, unsigned begin, unsigned length)
             page,begin,length, GetPageSize());
     }
     
-    iterator i = find(page);
-    if(i == end()) return;
-    
-    freespaceset &spaceset = i->second;
+    if(find(page) == end()) return;
     
-    spaceset.erase(begin, begin+length);
-    spaceset.compact();
+    EraseRange(page, begin, begin+length);
 }
 void freespacemap::Del(unsigned longaddr, unsigned length)
 {
@@ -245,8 +228,73 @@ void freespacemap::Del(unsigned longaddr, unsigned length)
 
 void freespacemap::Compact()
 {
-    for(iterator i = begin(); i != end(); ++i)
+    for(iterator i = pagemap::begin(); i != pagemap::end(); ++i)
+    {
+        Unindex(i->first, 0, ~0U);
         i->second.compact();
+        Reindex(i->first, 0, ~0U);
+    }
+}
+
+/* The pages are kept compact: Add() joins the new range with
+ * the ones it touches, and erasing never makes ranges touch.
+ * So only the ranges around the change need to be looked at.
+ */
+void freespacemap::SetRange(unsigned page, unsigned lo, unsigned up)
+{
+    if(lo >= up) return;
+    
+    freespaceset &spaceset = operator[] (page);
+    
+    freespaceset::const_iterator i;
+    if(lo > 0 && (i = spaceset.find(lo-1)) != spaceset.end()) lo = i->lower;
+    if((i = spaceset.find(up)) != spaceset.end()) up = i->upper;
+    
+    Unindex(page, lo, up);
+    spaceset.set(lo, up);
+    Reindex(page, lo, up);
+}
+
+void freespacemap::EraseRange(unsigned page, unsigned lo, unsigned up)
+{
+    if(lo >= up) return;
+    
+    freespaceset &spaceset = operator[] (page);
+    
+    Unindex(page, lo, up);
+    spaceset.erase(lo, up);
+    /* The parts left on either side */
+    Reindex(page, lo > 0 ? lo-1 : 0, up+1);
+}
+
+void freespacemap::Unindex(unsigned page, unsigned lo, unsigned up)
+{
+    const_iterator i = find(page);
+    if(i == end()) return;
+    
+    vector<freespaceset::const_iterator> ranges;
+    i->second.find_all_coinciding(lo, up, ranges);
+    for(unsigned a=0; a<ranges.size(); ++a)
+    {
+        freespacehole hole(ranges[a]->length(), page, ranges[a]->lower);
+        holes_by_size.erase(hole);
+        holes_by_page.erase(hole);
+    }
+}
+
+void freespacemap::Reindex(unsigned page, unsigned lo, unsigned up)
+{
+    const_iterator i = find(page);
+    if(i == end()) return;
+    
+    vector<freespaceset::const_iterator> ranges;
+    i->second.find_all_coinciding(lo, up, ranges);
+    for(unsigned a=0; a<ranges.size(); ++a)
+    {
+        freespacehole hole(ranges[a]->length(), page, ranges[a]->lower);
+        holes_by_size.insert(hole);
+        holes_by_page.insert(hole);
+    }
 }
 
 bool freespacemap::Organize(vector<freespacerec> &blocks, unsigned pagenum)
@@ -265,32 +313,11 @@ bool freespacemap::Organize(vector<freespacerec> &blocks, unsigned pagenum)
         return true;
     }
     
-    const freespaceset &pagemap = i->second;
-    
-    vector<unsigned> items;
-    vector<unsigned> holes;
-    vector<unsigned> holeaddrs;
-    
-    items.reserve(blocks.size());
-    
     unsigned totalsize = 0;
     for(unsigned a=0; a<blocks.size(); ++a)
-    {
         totalsize += blocks[a].len;
-        items.push_back(blocks[a].len);
-    }
     
-    unsigned totalspace = 0;
-    holes.reserve(pagemap.size());
-    holeaddrs.reserve(pagemap.size());
-    for(freespaceset::const_iterator i = pagemap.begin(); i != pagemap.end(); ++i)
-    {
-        const unsigned recpos = i->lower;
-        const unsigned reclen = i->upper - recpos;
-        totalspace += reclen;
-        holes.push_back(reclen);
-        holeaddrs.push_back(recpos);
-    }
+    unsigned totalspace = Size(pagenum);
     
     if(totalspace < totalsize)
     {
@@ -304,36 +331,197 @@ bool freespacemap::Organize(vector<freespacerec> &blocks, unsigned pagenum)
         }
     }
     
-    vector<unsigned> organization = PackBins(holes, items);
+    vector<unsigned> positions;
+    bool Errors = PlanOrganize(blocks, i->second, positions, GetPackTimeLeft());
     
+    for(unsigned a=0; a<blocks.size(); ++a)
+    {
+        blocks[a].pos = positions[a];
+        if(positions[a] != NOWHERE)
+            Del(pagenum, positions[a], blocks[a].len);
+    }
+    if(Errors)
+        if(!quiet)
+        {
+            fprintf(stderr, "ERROR: Organization to page %02X failed\n", pagenum);
+            if(log)
+            fprintf(log, "ERROR: Organization to page %02X failed\n", pagenum);
+        }
+    return Errors;
+}
+
+namespace
+{
+    const unsigned NoFit = ~0U;
+    
+    /* Where in the hole [addr, addr+len) the block may go
+     * with its alignment and boundary, or NoFit.
+     */
+    unsigned FitConstrained(const freespacerec& block, unsigned addr, unsigned len)
+    {
+        unsigned align = block.align > 1 ? block.align : 1;
+        unsigned bound = block.nocross;
+        
+        /* A block longer than the boundary will cross it
+         * anyway; the least it can do is begin at one.
+         */
+        if(bound && block.len > bound)
+        {
+            if(bound > align) align = bound;
+            bound = 0;
+        }
+        
+        unsigned pos = (addr + align-1) & ~(align-1);
+        if(bound && block.len && pos / bound != (pos + block.len - 1) / bound)
+            pos = ((pos / bound + 1) * bound + align-1) & ~(align-1);
+        
+        if(pos + block.len > addr + len) return NoFit;
+        return pos;
+    }
+    
+    /* The strictest constraints first, then the biggest blocks */
+    class ConstrainedOrder
+    {
+        const vector<freespacerec>& blocks;
+        
+        static unsigned Strictness(const freespacerec& b)
+        {
+            return b.align > b.nocross ? b.align : b.nocross;
+        }
+    public:
+        ConstrainedOrder(const vector<freespacerec>& b): blocks(b) { }
+        
+        bool operator() (unsigned a, unsigned b) const
+        {
+            unsigned sa = Strictness(blocks[a]), sb = Strictness(blocks[b]);
+            if(sa != sb) return sa > sb;
+            return blocks[a].len > blocks[b].len;
+        }
+    };
+}
+
+/* Blocks that have an alignment or a boundary are placed
+ * first, each at the lowest address where it may go. The
+ * gaps left before them stay free, and the bin packer gets
+ * those along with the rest of the holes for the other blocks.
+ *
+ * positions[] gets the address of each block (in the same
+ * terms as holeaddrs[]), or NoFit.
+ */
+bool freespacemap::PackBlocks(const vector<freespacerec> &blocks,
+                              vector<unsigned> &holes,
+                              vector<unsigned> &holeaddrs,
+                              vector<unsigned> &positions,
+                              double time_budget)
+{
     bool Errors = false;
+    positions.assign(blocks.size(), NoFit);
+    
+    vector<unsigned> constrained;
+    vector<unsigned> items;
+    vector<unsigned> itemblocks;
+    
+    items.reserve(blocks.size());
+    itemblocks.reserve(blocks.size());
     for(unsigned a=0; a<blocks.size(); ++a)
+        if(blocks[a].IsConstrained())
+            constrained.push_back(a);
+        else
+        {
+            items.push_back(blocks[a].len);
+            itemblocks.push_back(a);
+        }
+    
+    stable_sort(constrained.begin(), constrained.end(), ConstrainedOrder(blocks));
+    
+    for(unsigned c=0; c<constrained.size(); ++c)
+    {
+        const freespacerec& block = blocks[constrained[c]];
+        
+        unsigned besthole = NoFit, bestpos = 0, bestwaste = 0;
+        for(unsigned h=0; h<holes.size(); ++h)
+        {
+            unsigned pos = FitConstrained(block, holeaddrs[h], holes[h]);
+            if(pos == NoFit) continue;
+            
+            if(besthole == NoFit || pos < bestpos)
+            {
+                besthole  = h;
+                bestpos   = pos;
+                bestwaste = pos - holeaddrs[h];
+            }
+        }
+        if(besthole == NoFit)
+        {
+            Errors = true;
+            continue;
+        }
+        positions[constrained[c]] = bestpos;
+        
+        /* The gap before the block stays where it was,
+         * and what is left after it becomes a new hole.
+         */
+        unsigned tail    = bestpos + block.len;
+        unsigned taillen = holeaddrs[besthole] + holes[besthole] - tail;
+        if(!bestwaste)
+        {
+            holeaddrs[besthole] = tail;
+            holes[besthole]     = taillen;
+        }
+        else
+        {
+            holes[besthole] = bestwaste;
+            if(taillen)
+            {
+                holeaddrs.push_back(tail);
+                holes.push_back(taillen);
+            }
+        }
+    }
+    
+    vector<unsigned> organization = PackBins(holes, items, time_budget);
+    
+    for(unsigned a=0; a<items.size(); ++a)
     {
-        unsigned itemsize = blocks[a].len;
+        unsigned itemsize = items[a];
         unsigned holeid   = organization[a];
         
-        unsigned spaceptr = NOWHERE;
         if(holeid < holes.size()
         && holes[holeid] >= itemsize)
         {
-            spaceptr = holeaddrs[holeid];
+            positions[itemblocks[a]] = holeaddrs[holeid];
             holeaddrs[holeid] += itemsize;
             holes[holeid]     -= itemsize;
-            Del(pagenum, spaceptr, itemsize);
         }
         else
         {
             Errors = true;
         }
-        blocks[a].pos = spaceptr;
     }
-    if(Errors)
-        if(!quiet)
-        {
-            fprintf(stderr, "ERROR: Organization to page %02X failed\n", pagenum);
-            if(log)
-            fprintf(log, "ERROR: Organization to page %02X failed\n", pagenum);
-        }
+    return Errors;
+}
+
+bool freespacemap::PlanOrganize(const vector<freespacerec> &blocks,
+                                const freespaceset &pagemap,
+                                vector<unsigned> &positions,
+                                double time_budget)
+{
+    vector<unsigned> holes;
+    vector<unsigned> holeaddrs;
+    
+    holes.reserve(pagemap.size());
+    holeaddrs.reserve(pagemap.size());
+    for(freespaceset::const_iterator i = pagemap.begin(); i != pagemap.end(); ++i)
+    {
+        holes.push_back(i->length());
+        holeaddrs.push_back(i->lower);
+    }
+    
+    bool Errors = PackBlocks(blocks, holes, holeaddrs, positions, time_budget);
+    
+    for(unsigned a=0; a<positions.size(); ++a)
+        if(positions[a] == NoFit)
+            positions[a] = NOWHERE;
     return Errors;
 }
 
@@ -341,19 +529,12 @@ bool freespacemap::OrganizeToAnyPage(vector<freespacerec> &blocks)
 {
     FILE *log = GetLogFile("mem", "log_addrs");
 
-    vector<unsigned> items;
     vector<unsigned> holes;
-    vector<unsigned> holepages;
     vector<unsigned> holeaddrs;
     
-    items.reserve(blocks.size());
-    
     unsigned totalsize = 0;
     for(unsigned a=0; a<blocks.size(); ++a)
-    {
         totalsize += blocks[a].len;
-        items.push_back(blocks[a].len);
-    }
 
     unsigned totalspace = 0;
     for(const_iterator i=begin(); i!=end(); ++i)
@@ -367,8 +548,7 @@ bool freespacemap::OrganizeToAnyPage(vector<freespacerec> &blocks)
             const unsigned reclen = j->upper - recpos;
             totalspace += reclen;
             holes.push_back(reclen);
-            holeaddrs.push_back(recpos);
-            holepages.push_back(pagenum);
+            holeaddrs.push_back(recpos + (pagenum * GetPageSize()));
         }
     }
     
@@ -384,26 +564,16 @@ bool freespacemap::OrganizeToAnyPage(vector<freespacerec> &blocks)
         }
     }
     
-    vector<unsigned> organization = PackBins(holes, items);
+    vector<unsigned> positions;
+    bool Errors = PackBlocks(blocks, holes, holeaddrs, positions, GetPackTimeLeft());
     
-    bool Errors = false;
     for(unsigned a=0; a<blocks.size(); ++a)
     {
-        unsigned itemsize = blocks[a].len;
-        unsigned holeid   = organization[a];
-        
         unsigned spaceptr = NOWHERE;
-        if(holes[holeid] >= itemsize)
+        if(positions[a] != NoFit)
         {
-            unsigned pagenum = holepages[holeid];
-            spaceptr = holeaddrs[holeid] + (pagenum * GetPageSize());
-            holeaddrs[holeid] += itemsize;
-            holes[holeid]     -= itemsize;
-            Del(spaceptr, itemsize);
-        }
-        else
-        {
-            Errors = true;
+            spaceptr = positions[a];
+            Del(spaceptr, blocks[a].len);
         }
         blocks[a].pos = spaceptr;
     }
@@ -417,45 +587,99 @@ bool freespacemap::OrganizeToAnyPage(vector<freespacerec> &blocks)
     return Errors;
 }
 
-bool freespacemap::OrganizeToAnySamePage(vector<freespacerec> &blocks, unsigned &page)
+double freespacemap::GetPackTimeLeft() const
 {
-    // To do:
-    //   1. Pick a page where they all fit the best
-    //   2. Organize there.
+    double left = pack_deadline - BinPackerTime();
+    return left > 0 ? left : 0.0;
+}
+
+/* Tries whether the blocks fit in each of the given pages.
+ * The map is not changed while this runs, so the pages can
+ * be tried at the same time. Each try may search for a
+ * better packing until the deadline, if one is given.
+ */
+class freespacemap::PageTrier
+{
+public:
+    struct Trial
+    {
+        unsigned pagenum;
+        const freespaceset* pagemap;
+        bool fits;
+    };
     
-    freespacemap saved_this = *this;
-    quiet = true;
+    PageTrier(const vector<freespacerec>& b, vector<Trial>& t, double d)
+        : blocks(b), trials(t), deadline(d) { }
     
+    void operator() (unsigned n) const
+    {
+        if(trials[n].fits) return;
+        
+        double left = deadline - BinPackerTime();
+        vector<unsigned> positions;
+        trials[n].fits = !PlanOrganize(blocks, *trials[n].pagemap, positions,
+                                       left > 0 ? left : 0.0);
+    }
+private:
+    const vector<freespacerec>& blocks;
+    vector<Trial>& trials;
+    double deadline;
+};
+
+bool freespacemap::FindSamePage(const vector<freespacerec> &blocks, unsigned &page) const
+{
+    // The pages are only tried out, so nothing needs to be undone.
+    
+    unsigned totalsize = 0;
+    for(unsigned a=0; a<blocks.size(); ++a)
+        totalsize += blocks[a].len;
+    
+    vector<PageTrier::Trial> trials;
+    vector<unsigned> freesizes;
+    for(const_iterator i=begin(); i!=end(); ++i)
+    {
+        unsigned pagesize = Size(i->first);
+        if(pagesize < totalsize) continue;
+        
+        PageTrier::Trial trial = { i->first, &i->second, false };
+        trials.push_back(trial);
+        // What would be left after organizing there
+        freesizes.push_back(pagesize - totalsize);
+    }
+    
+    /* First with the fast method only. If it fits in no page,
+     * the pages are searched again with what is left of the time.
+     */
+    bool any = false;
+    for(unsigned pass=0; pass<2 && !any; ++pass)
+    {
+        if(pass > 0 && GetPackTimeLeft() <= 0) break;
+        
+        PageTrier trier(blocks, trials, pass ? pack_deadline : 0.0);
+        if(pool)
+            pool->RunEach(trier, (unsigned)trials.size());
+        else
+            for(unsigned a=0; a<trials.size(); ++a)
+                trier(a);
+        
+        for(unsigned a=0; a<trials.size(); ++a)
+            if(trials[a].fits) any = true;
+    }
+    
+    /* In page order, so that ties go to the lowest page */
     unsigned bestpagenum = 0xFF; /* Guess */
     unsigned bestpagesize = 0;
     bool first = true;
     bool candidates = false;
-    for(const_iterator i=begin(); i!=end(); ++i)
+    for(unsigned a=0; a<trials.size(); ++a)
     {
-        unsigned pagenum = i->first;
-        
-        vector<freespacerec> tmpblocks = blocks;
-        
-        if(!Organize(tmpblocks, pagenum))
+        if(trials[a].fits)
         {
             // candidate!
-            
-            // Can't use previous reference because things have changed
-            // FIXME: Is this really the case?
-            const freespaceset &pagemap = find(pagenum)->second;
-            
-            unsigned freesize = 0;
-            freespaceset::const_iterator j;
-            for(j=pagemap.begin(); j!=pagemap.end(); ++j)
+            if(first || freesizes[a] < bestpagesize)
             {
-                unsigned reclen = j->length();
-                freesize += reclen;
-            }
-
-            if(first || freesize < bestpagesize)
-            {
-                bestpagenum  = pagenum;
-                bestpagesize = freesize;
+                bestpagenum  = trials[a].pagenum;
+                bestpagesize = freesizes[a];
                 first = false;
             }
             
@@ -463,57 +687,196 @@ bool freespacemap::OrganizeToAnySamePage(vector<freespacerec> &blocks, unsigned
         }
     }
     
-    *this = saved_this;
-
     page = bestpagenum;
+    return candidates;
+}
+
+bool freespacemap::OrganizeToAnySamePage(vector<freespacerec> &blocks, unsigned &page)
+{
+    // To do:
+    //   1. Pick a page where they all fit the best
+    //   2. Organize there.
     
-    if(!candidates)
+    if(!FindSamePage(blocks, page))
     {
         fprintf(stderr, "Warning: All pages seem to be too small\n");
     }
 
-    return Organize(blocks, bestpagenum);
+    return Organize(blocks, page);
 }
 
 unsigned freespacemap::FindFromAnyPage(unsigned length)
 {
     FILE *log = GetLogFile("mem", "log_addrs");
 
-    unsigned leastfree=0, bestpage=0xFF; /* guess */
-    bool first=true;
-    for(const_iterator i=begin(); i!=end(); ++i)
-    {
-        const freespaceset &pagemap = i->second;
-        
-        freespaceset::const_iterator j;
-        for(j=pagemap.begin(); j!=pagemap.end(); ++j)
-        {
-            unsigned reclen = j->length();
-            if(reclen < length) continue;
-            if(first || reclen < leastfree)
-            {
-                bestpage  = i->first;
-                leastfree = reclen;
-                first = false;
-            }
-        }
-    }
-    if(first)
+    // The smallest hole that fits, on the first page that has one.
+    set<freespacehole>::const_iterator
+        best = holes_by_size.lower_bound(freespacehole(length, 0, 0));
+    
+    if(best == holes_by_size.end())
     {
         fprintf(stderr, "No %u-byte free space block available!\n", length);
         if(log)
             fprintf(log, "No %u-byte free space block available!\n", length);
         return NOWHERE;
     }
+    unsigned bestpage = best->page;
     return Find(bestpage, length) + (bestpage * GetPageSize());
 }
 
 #include "o65linker.hh"
 
+static freespacerec MakeBlock(unsigned size, const LinkageWish& wish)
+{
+    freespacerec result(size);
+    result.align   = wish.align;
+    result.nocross = wish.nocross;
+    return result;
+}
+
+namespace
+{
+    /* Heaviest first; the rest is for a stable order */
+    struct CallPair
+    {
+        unsigned weight, a, b;
+        
+        bool operator< (const CallPair& o) const
+        {
+            if(weight != o.weight) return weight > o.weight;
+            if(a != o.a) return a < o.a;
+            return b < o.b;
+        }
+    };
+    
+    /* (size, root): bigger first, then the lower root */
+    bool BiggerCluster(const pair<unsigned, unsigned>& a, const pair<unsigned, unsigned>& b)
+    {
+        if(a.first != b.first) return a.first > b.first;
+        return a.second < b.second;
+    }
+    
+    unsigned FindRoot(vector<unsigned>& parent, unsigned a)
+    {
+        while(parent[a] != a) a = parent[a] = parent[parent[a]];
+        return a;
+    }
+}
+
+/* The objects are joined into clusters along the heaviest
+ * calls first, as long as the cluster could still fit in a
+ * page. Each cluster is then placed like a linkage group;
+ * if it fits in no page, its objects are left for the rest.
+ */
+void freespacemap::OrganizeCallClusters(const vector<unsigned> &sizes,
+                                        const vector<LinkageWish> &linkages,
+                                        vector<unsigned> &items,
+                                        vector<unsigned> &addrs)
+{
+    const unsigned n = (unsigned)sizes.size();
+    
+    vector<bool> movable(n);
+    for(unsigned c=0; c<items.size(); ++c)
+        movable[items[c]] = true;
+    
+    /* A pair is weighed by its JSLs, both ways. Those could become
+     * JSRs in the same bank, and are what --stats reports; other
+     * long references gain nothing from it.
+     */
+    map<pair<unsigned, unsigned>, unsigned> weights;
+    for(unsigned e=0; e<call_graph->size(); ++e)
+    {
+        const CallEdge& edge = (*call_graph)[e];
+        if(edge.from >= n || edge.to >= n || !edge.calls
+        || !movable[edge.from] || !movable[edge.to]) continue;
+        weights[make_pair(min(edge.from, edge.to), max(edge.from, edge.to))] += edge.calls;
+    }
+    
+    vector<CallPair> pairs;
+    for(map<pair<unsigned, unsigned>, unsigned>::const_iterator
+        i = weights.begin(); i != weights.end(); ++i)
+    {
+        CallPair p = { i->second, i->first.first, i->first.second };
+        pairs.push_back(p);
+    }
+    sort(pairs.begin(), pairs.end());
+    
+    unsigned limit = 0;
+    for(const_iterator i=begin(); i!=end(); ++i)
+        limit = max(limit, Size(i->first));
+    
+    vector<unsigned> parent(n), clustersize(n);
+    for(unsigned a=0; a<n; ++a)
+    {
+        parent[a] = a;
+        clustersize[a] = sizes[a];
+    }
+    for(unsigned p=0; p<pairs.size(); ++p)
+    {
+        unsigned a = FindRoot(parent, pairs[p].a);
+        unsigned b = FindRoot(parent, pairs[p].b);
+        if(a == b || clustersize[a] + clustersize[b] > limit) continue;
+        if(b < a) std::swap(a, b);
+        parent[b] = a;
+        clustersize[a] += clustersize[b];
+    }
+    
+    map<unsigned, vector<unsigned> > clusters;
+    for(unsigned c=0; c<items.size(); ++c)
+        clusters[FindRoot(parent, items[c])].push_back(items[c]);
+    
+    /* The biggest clusters first, while there is room */
+    vector<pair<unsigned, unsigned> > order;
+    for(map<unsigned, vector<unsigned> >::const_iterator
+        i = clusters.begin(); i != clusters.end(); ++i)
+        if(i->second.size() > 1)
+            order.push_back(make_pair(clustersize[i->first], i->first));
+    sort(order.begin(), order.end(), BiggerCluster);
+    
+    vector<bool> placed(n);
+    for(unsigned o=0; o<order.size(); ++o)
+    {
+        const vector<unsigned>& members = clusters[order[o].second];
+        
+        vector<freespacerec> Organization(members.size());
+        for(unsigned c=0; c<members.size(); ++c)
+            Organization[c] = MakeBlock(sizes[members[c]], linkages[members[c]]);
+        
+        unsigned page;
+        if(!FindSamePage(Organization, page)) continue;
+        Organize(Organization, page);
+        
+        for(unsigned c=0; c<members.size(); ++c)
+        {
+            unsigned addr = Organization[c].pos;
+            if(addr == NOWHERE) continue;
+            addrs[members[c]] = addr + page * GetPageSize();
+            placed[members[c]] = true;
+        }
+    }
+    
+    vector<unsigned> rest;
+    for(unsigned c=0; c<items.size(); ++c)
+        if(!placed[items[c]])
+            rest.push_back(items[c]);
+    items.swap(rest);
+}
+
+/* The free space may be listed through either FastROM alias of the address */
+void freespacemap::Reserve(unsigned longaddr, unsigned length)
+{
+    Del(longaddr, length);
+    unsigned alias = SlowROMaddr(longaddr);
+    if(alias == longaddr) alias = FastROMaddr(longaddr);
+    if(alias != longaddr) Del(alias, length);
+}
+
 void freespacemap::OrganizeO65linker(O65linker& objects, const SegmentSelection seg)
 {
     Compact();
     
+    pack_deadline = BinPackerTime() + pack_time_budget;
+    
     vector<unsigned> sizes = objects.GetSizeList(seg);
     vector<unsigned> addrs = objects.GetAddrList(seg);
     
@@ -540,13 +903,19 @@ void freespacemap::OrganizeO65linker(O65linker& objects, const SegmentSelection
                 items.push_back(a);
                 break;
             case LinkageWish::LinkHere:
-            {
-                /* No linking, just ensure we won't overwrite it */
-                Del(addrs[a], sizes[a]);
+                /* No linking, just ensure we won't overwrite it. */
+                Reserve(addrs[a], sizes[a]);
                 break;
-            }
         }
     
+    /* Nor where the references are patched in */
+    if(seg == CODE)
+    {
+        const vector<pair<unsigned, unsigned> > sites = objects.GetReferenceSites();
+        for(unsigned a=0; a<sites.size(); ++a)
+            Reserve(sites[a].first, sites[a].second);
+    }
+    
     /* FIRST link those which require specific pages */
 
     /* Link each page. */
@@ -559,7 +928,7 @@ void freespacemap::OrganizeO65linker(O65linker& objects, const SegmentSelection
         vector<freespacerec> Organization(items.size());
         
         for(unsigned c=0; c<items.size(); ++c)
-            Organization[c].len = sizes[items[c]];
+            Organization[c] = MakeBlock(sizes[items[c]], linkages[items[c]]);
         
         Organize(Organization, page);
         
@@ -586,7 +955,7 @@ void freespacemap::OrganizeO65linker(O65linker& objects, const SegmentSelection
         vector<freespacerec> Organization(items.size());
 
         for(unsigned c=0; c<items.size(); ++c)
-            Organization[c].len = sizes[items[c]];
+            Organization[c] = MakeBlock(sizes[items[c]], linkages[items[c]]);
         
         unsigned page = NOWHERE;
         OrganizeToAnySamePage(Organization, page);
@@ -602,12 +971,17 @@ void freespacemap::OrganizeO65linker(O65linker& objects, const SegmentSelection
         }
     }
     
+    /* THEN put those which call each other in the same pages */
+    
+    if(call_graph && seg == CODE)
+        OrganizeCallClusters(sizes, linkages, items, addrs);
+    
     /* LAST link those which go anywhere */
 
     vector<freespacerec> Organization(items.size());
 
     for(unsigned c=0; c<items.size(); ++c)
-        Organization[c].len = sizes[items[c]];
+        Organization[c] = MakeBlock(sizes[items[c]], linkages[items[c]]);
 
     OrganizeToAnyPage(Organization);
     
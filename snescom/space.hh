@@ -8,16 +8,22 @@
 #include "rangeset.hh"
 #include "o65.hh" /* For SegmentSelection */
 
+struct LinkageWish;
+
 #define NOWHERE 0x10000
 
 struct freespacerec
 {
     unsigned pos;
     unsigned len;
+    unsigned align;   // pos must be a multiple of this; 0 = any
+    unsigned nocross; // must not cross a multiple of this; 0 = may
+    
+    freespacerec() : pos(NOWHERE), len(0), align(0), nocross(0) {}
+    freespacerec(unsigned l) : pos(NOWHERE), len(l), align(0), nocross(0) {}
+    freespacerec(unsigned p,unsigned l) : pos(p), len(l), align(0), nocross(0) {}
     
-    freespacerec() : pos(NOWHERE), len(0) {}
-    freespacerec(unsigned l) : pos(NOWHERE), len(l) {}
-    freespacerec(unsigned p,unsigned l) : pos(p), len(l) {}
+    bool IsConstrained() const { return align > 1 || nocross > 0; }
     
     bool operator< (const freespacerec &b) const
     {
@@ -28,10 +34,51 @@ struct freespacerec
 
 typedef rangeset<unsigned> freespaceset;
 
+/* A free range, for finding free ranges by their size */
+struct freespacehole
+{
+    unsigned len;
+    unsigned page;
+    unsigned pos;
+    
+    freespacehole(unsigned l, unsigned pg, unsigned p) : len(l), page(pg), pos(p) {}
+    
+    /* By size, then by address */
+    bool operator< (const freespacehole &b) const
+    {
+        if(len != b.len) return len < b.len;
+        if(page != b.page) return page < b.page;
+        return pos < b.pos;
+    }
+    /* By page, then by size and position */
+    struct PageOrder
+    {
+        bool operator() (const freespacehole &a, const freespacehole &b) const
+        {
+            if(a.page != b.page) return a.page < b.page;
+            if(a.len != b.len) return a.len < b.len;
+            return a.pos < b.pos;
+        }
+    };
+};
+
 /* (rom)page -> list */
-class freespacemap : public std::map<unsigned, freespaceset>
+class freespacemap : private std::map<unsigned, freespaceset>
 {
+    typedef std::map<unsigned, freespaceset> pagemap;
+    
     bool quiet;
+    double pack_time_budget;
+    double pack_deadline; // of the current OrganizeO65linker()
+    class ThreadPool* pool;
+    const std::vector<struct CallEdge>* call_graph;
+    
+    /* The same ranges as in the map, indexed by size.
+     * This is why the map is private, and the ranges
+     * are only changed with Add() and Del().
+     */
+    std::set<freespacehole> holes_by_size;
+    std::set<freespacehole, freespacehole::PageOrder> holes_by_page;
 public:
     /*
     
@@ -47,6 +94,11 @@ public:
     
     freespacemap();
     
+    /* The pages and their free ranges, read-only */
+    typedef pagemap::const_iterator const_iterator;
+    const_iterator begin() const { return pagemap::begin(); }
+    const_iterator end() const { return pagemap::end(); }
+    
     void Report() const;
     void DumpPageMap(unsigned pagenum) const;
     
@@ -62,8 +114,29 @@ public:
     
     void OrganizeO65linker(class O65linker& objects, const SegmentSelection seg = CODE);
     
+    /* Time to spend on the packings that the fast method fails,
+     * in all of one OrganizeO65linker() call together
+     */
+    void SetPackTimeBudget(double seconds) { pack_time_budget = seconds; }
+    
+    /* Pages for linkage groups are tried out in these threads */
+    void SetThreadPool(class ThreadPool* p) { pool = p; }
+    
+    /* Objects that call each other a lot are put in the same
+     * pages, when organizing CODE. The graph must stay alive.
+     */
+    void SetCallGraph(const std::vector<struct CallEdge>* graph) { call_graph = graph; }
+    
     const std::set<unsigned> GetPageList() const;
     const freespaceset& GetList(unsigned pagenum) const;
+    
+    // Free bytes in all pages, or in one page
+    unsigned Size() const;
+    unsigned Size(unsigned page) const;
+    // The number of free ranges in the page
+    unsigned GetFragmentation(unsigned page) const;
+    // The length of the largest free range in the page
+    unsigned GetLargestHole(unsigned page) const;
 
     /* These don't need to be private, but they are
      * now to ensure Chronotools doesn't use them.
@@ -74,13 +147,24 @@ private:
     // Returns abbsolute address (24-bit)
     unsigned FindFromAnyPage(unsigned length);
     
-    unsigned Size() const;
-    unsigned Size(unsigned page) const;
-    unsigned GetFragmentation(unsigned page) const;
-    
     // Uses segment-relative addresses (16-bit)
     bool Organize(std::vector<freespacerec> &blocks, unsigned pagenum);
     // Return value: errors-flag
+    
+    // Packs the blocks into the holes; see space.cc
+    static bool PackBlocks(const std::vector<freespacerec> &blocks,
+                           std::vector<unsigned> &holes,
+                           std::vector<unsigned> &holeaddrs,
+                           std::vector<unsigned> &positions,
+                           double time_budget);
+    // Return value: errors-flag
+    
+    // Where Organize() would put the blocks, without changing anything
+    static bool PlanOrganize(const std::vector<freespacerec> &blocks,
+                             const freespaceset &pagemap,
+                             std::vector<unsigned> &positions,
+                             double time_budget);
+    // Return value: errors-flag
 
     // Uses absolute addresses (24-bit)
     bool OrganizeToAnyPage(std::vector<freespacerec> &blocks);
@@ -90,7 +174,32 @@ private:
     bool OrganizeToAnySamePage(std::vector<freespacerec> &blocks, unsigned &page);
     // Return value: errors-flag
     
+    // The page where the blocks fit the best, without changing anything
+    bool FindSamePage(const std::vector<freespacerec> &blocks, unsigned &page) const;
+    // Return value: whether they fit anywhere
+    
+    // Puts the clusters of the call graph in pages of their own,
+    // and removes the objects so placed from items
+    void OrganizeCallClusters(const std::vector<unsigned> &sizes,
+                              const std::vector<LinkageWish> &linkages,
+                              std::vector<unsigned> &items,
+                              std::vector<unsigned> &addrs);
+    
     void Compact();
+    
+    // Uses absolute addresses; takes out both FastROM aliases
+    void Reserve(unsigned longaddr, unsigned length);
+    
+    // What is left of the pack time budget, in seconds
+    double GetPackTimeLeft() const;
+    
+    // Segment-relative; these keep the size index in sync
+    void SetRange(unsigned page, unsigned lo, unsigned up);
+    void EraseRange(unsigned page, unsigned lo, unsigned up);
+    void Unindex(unsigned page, unsigned lo, unsigned up);
+    void Reindex(unsigned page, unsigned lo, unsigned up);
+    
+    class PageTrier;
 };
 
 #endif
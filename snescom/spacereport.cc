@@ -0,0 +1,173 @@
+#include <map>
+
+#include "spacereport.hh"
+#include "o65linker.hh"
+#include "space.hh"
+#include "romaddr.hh"
+
+namespace
+{
+    const std::string JSONstring(const std::string& s)
+    {
+        std::string result = "\"";
+        for(unsigned a=0; a<s.size(); ++a)
+        {
+            unsigned char c = s[a];
+            if(c == '"' || c == '\\')
+            {
+                result += '\\';
+                result += c;
+            }
+            else if(c < 0x20)
+            {
+                char Buf[8];
+                std::sprintf(Buf, "\\u%04X", c);
+                result += Buf;
+            }
+            else
+                result += c;
+        }
+        return result + '"';
+    }
+}
+
+void SpaceReport::Record(const char* when, SegmentSelection seg,
+                         const freespacemap& space, const O65linker& linker)
+{
+    Snapshot snap;
+    snap.when    = when;
+    snap.segment = GetSegmentName(seg);
+    snap.pending = 0;
+
+    std::map<unsigned, Bank> banks;
+
+    const std::set<unsigned> pages = space.GetPageList();
+    for(std::set<unsigned>::const_iterator i = pages.begin(); i != pages.end(); ++i)
+    {
+        Bank& bank = banks[*i];
+        bank.free    = space.Size(*i);
+        bank.hunks   = space.GetFragmentation(*i);
+        bank.largest = space.GetLargestHole(*i);
+    }
+
+    const std::vector<unsigned> addrs = linker.GetAddrList(seg);
+    const std::vector<unsigned> sizes = linker.GetSizeList(seg);
+    const std::vector<LinkageWish> linkages = linker.GetLinkageList(seg);
+    for(unsigned a=0; a<sizes.size(); ++a)
+    {
+        if(!sizes[a]) continue;
+        if(linkages[a].type != LinkageWish::LinkHere)
+        {
+            ++snap.pending;
+            continue;
+        }
+        if(addrs[a] == NOWHERE)
+        {
+            Failure failure;
+            failure.objno = a+1;
+            failure.name  = linker.GetName(a);
+            failure.size  = sizes[a];
+            snap.failed.push_back(failure);
+            continue;
+        }
+
+        /* An object may go over the end of its page */
+        unsigned addr = addrs[a], left = sizes[a];
+        while(left > 0)
+        {
+            unsigned page  = addr / GetPageSize();
+            unsigned count = (page+1) * GetPageSize() - addr;
+            if(count > left) count = left;
+            banks[page].used += count;
+            addr += count;
+            left -= count;
+        }
+    }
+
+    for(std::map<unsigned, Bank>::iterator i = banks.begin(); i != banks.end(); ++i)
+    {
+        i->second.page = i->first;
+        snap.banks.push_back(i->second);
+    }
+    snapshots.push_back(snap);
+}
+
+void SpaceReport::Print(std::FILE* fp) const
+{
+    for(unsigned a=0; a<snapshots.size(); ++a)
+    {
+        const Snapshot& snap = snapshots[a];
+        std::fprintf(fp, "Space report: %s, %s organizing, %u object(s) to place\n",
+            snap.segment.c_str(), snap.when.c_str(), snap.pending);
+
+        unsigned used = 0, free = 0;
+        for(unsigned b=0; b<snap.banks.size(); ++b)
+        {
+            const Bank& bank = snap.banks[b];
+            std::fprintf(fp, "  bank $%02X: %6u used, %6u free in %3u hunk(s), largest %5u,"
+                             " fragmentation %.2f\n",
+                bank.page, bank.used, bank.free, bank.hunks, bank.largest,
+                bank.GetFragmentation());
+            used += bank.used;
+            free += bank.free;
+        }
+        std::fprintf(fp, "  total: %u used, %u free\n", used, free);
+
+        for(unsigned b=0; b<snap.failed.size(); ++b)
+            std::fprintf(fp, "  did not fit: object %u (%s), %u bytes\n",
+                snap.failed[b].objno, snap.failed[b].name.c_str(), snap.failed[b].size);
+    }
+}
+
+bool SpaceReport::WriteJSON(const std::string& filename) const
+{
+    std::FILE* fp = std::fopen(filename.c_str(), "wt");
+    if(!fp)
+    {
+        std::perror(filename.c_str());
+        return false;
+    }
+
+    std::fprintf(fp, "{\n  \"snapshots\": [");
+    for(unsigned a=0; a<snapshots.size(); ++a)
+    {
+        const Snapshot& snap = snapshots[a];
+        std::fprintf(fp, "%s\n    {\n", a ? "," : "");
+        std::fprintf(fp, "      \"segment\": %s,\n", JSONstring(snap.segment).c_str());
+        std::fprintf(fp, "      \"when\": %s,\n", JSONstring(snap.when).c_str());
+        std::fprintf(fp, "      \"pending\": %u,\n", snap.pending);
+
+        unsigned used = 0, free = 0;
+        std::fprintf(fp, "      \"banks\": [");
+        for(unsigned b=0; b<snap.banks.size(); ++b)
+        {
+            const Bank& bank = snap.banks[b];
+            std::fprintf(fp, "%s\n        { \"bank\": %u, \"used\": %u, \"free\": %u,"
+                             " \"hunks\": %u, \"largest\": %u, \"fragmentation\": %.4f }",
+                b ? "," : "",
+                bank.page, bank.used, bank.free, bank.hunks, bank.largest,
+                bank.GetFragmentation());
+            used += bank.used;
+            free += bank.free;
+        }
+        std::fprintf(fp, "%s],\n", snap.banks.empty() ? "" : "\n      ");
+        std::fprintf(fp, "      \"used\": %u,\n", used);
+        std::fprintf(fp, "      \"free\": %u,\n", free);
+
+        std::fprintf(fp, "      \"failed\": [");
+        for(unsigned b=0; b<snap.failed.size(); ++b)
+        {
+            const Failure& failure = snap.failed[b];
+            std::fprintf(fp, "%s\n        { \"object\": %u, \"name\": %s, \"size\": %u }",
+                b ? "," : "",
+                failure.objno, JSONstring(failure.name).c_str(), failure.size);
+        }
+        std::fprintf(fp, "%s]\n    }", snap.failed.empty() ? "" : "\n      ");
+    }
+    std::fprintf(fp, "%s]\n}\n", snapshots.empty() ? "" : "\n  ");
+
+    bool ok = !std::ferror(fp);
+    if(std::fclose(fp) != 0) ok = false;
+    if(!ok) std::perror(filename.c_str());
+    return ok;
+}
@@ -0,0 +1,58 @@
+#ifndef bqtSpaceReportHH
+#define bqtSpaceReportHH
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "o65.hh" /* For SegmentSelection */
+
+class O65linker;
+class freespacemap;
+
+/* For --space-report: how full each bank is, recorded
+ * before and after each segment is organized.
+ *
+ * The fragmentation index of a bank is 1 - largest/free:
+ * 0 when the free space is in one piece, and near 1 when
+ * it is in many small ones.
+ */
+class SpaceReport
+{
+public:
+    void Record(const char* when, SegmentSelection seg,
+                const freespacemap& space, const O65linker& linker);
+
+    void Print(std::FILE* fp) const;
+    bool WriteJSON(const std::string& filename) const;
+
+private:
+    struct Bank
+    {
+        unsigned page;
+        unsigned used;    // by objects placed in this segment
+        unsigned free;
+        unsigned hunks;   // free ranges
+        unsigned largest; // largest free range
+
+        double GetFragmentation() const
+            { return free ? 1.0 - (double)largest / free : 0.0; }
+    };
+    struct Failure
+    {
+        unsigned    objno;
+        std::string name;
+        unsigned    size;
+    };
+    struct Snapshot
+    {
+        std::string when;
+        std::string segment;
+        std::vector<Bank>    banks;
+        std::vector<Failure> failed; // objects that did not fit
+        unsigned pending;            // objects not placed yet
+    };
+    std::vector<Snapshot> snapshots;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include <vector>
+#include <unistd.h>
+
+#ifndef WIN32
+# include <pthread.h>
+# define USE_PTHREADS
+#endif
+
+#include "threadpool.hh"
+
+class ThreadPool::Impl
+{
+public:
+#ifdef USE_PTHREADS
+    std::vector<pthread_t> threads;
+    pthread_mutex_t lock;
+    pthread_cond_t  start; // signaled when a batch begins, or on quit
+    pthread_cond_t  done;  // signaled when a batch ends
+#endif
+    JobFunc  job;
+    void*    arg;
+    unsigned count;     // jobs in the current batch
+    unsigned next;      // next job to hand out
+    unsigned finished;  // jobs finished in the current batch
+    unsigned batch;     // incremented for each batch
+    bool     quit;
+
+    Impl(): job(0), arg(0), count(0), next(0), finished(0), batch(0), quit(false) { }
+};
+
+ThreadPool::ThreadPool(unsigned n)
+    : num_threads(n ? n : 1), impl(new Impl)
+{
+#ifdef USE_PTHREADS
+    pthread_mutex_init(&impl->lock, NULL);
+    pthread_cond_init(&impl->start, NULL);
+    pthread_cond_init(&impl->done, NULL);
+
+    /* The caller of Run() is one of the workers */
+    for(unsigned a=1; a<num_threads; ++a)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, ThreadMain, this) != 0) break;
+        impl->threads.push_back(thread);
+    }
+    num_threads = (unsigned)impl->threads.size() + 1;
+#else
+    num_threads = 1;
+#endif
+}
+
+ThreadPool::~ThreadPool()
+{
+#ifdef USE_PTHREADS
+    pthread_mutex_lock(&impl->lock);
+    impl->quit = true;
+    pthread_cond_broadcast(&impl->start);
+    pthread_mutex_unlock(&impl->lock);
+
+    for(unsigned a=0; a<impl->threads.size(); ++a)
+        pthread_join(impl->threads[a], NULL);
+
+    pthread_cond_destroy(&impl->done);
+    pthread_cond_destroy(&impl->start);
+    pthread_mutex_destroy(&impl->lock);
+#endif
+    delete impl;
+}
+
+void ThreadPool::Run(JobFunc job, void* arg, unsigned count)
+{
+    if(!count) return;
+#ifdef USE_PTHREADS
+    if(num_threads > 1 && count > 1)
+    {
+        pthread_mutex_lock(&impl->lock);
+        impl->job      = job;
+        impl->arg      = arg;
+        impl->count    = count;
+        impl->next     = 0;
+        impl->finished = 0;
+        ++impl->batch;
+        pthread_cond_broadcast(&impl->start);
+        pthread_mutex_unlock(&impl->lock);
+
+        Work();
+
+        pthread_mutex_lock(&impl->lock);
+        while(impl->finished < impl->count)
+            pthread_cond_wait(&impl->done, &impl->lock);
+        impl->count = 0;
+        pthread_mutex_unlock(&impl->lock);
+        return;
+    }
+#endif
+    for(unsigned a=0; a<count; ++a)
+        job(arg, a);
+}
+
+void ThreadPool::Work()
+{
+#ifdef USE_PTHREADS
+    pthread_mutex_lock(&impl->lock);
+    while(impl->next < impl->count)
+    {
+        unsigned jobno = impl->next++;
+        JobFunc job = impl->job;
+        void*   arg = impl->arg;
+        pthread_mutex_unlock(&impl->lock);
+
+        job(arg, jobno);
+
+        pthread_mutex_lock(&impl->lock);
+        if(++impl->finished == impl->count)
+            pthread_cond_broadcast(&impl->done);
+    }
+    pthread_mutex_unlock(&impl->lock);
+#endif
+}
+
+void* ThreadPool::ThreadMain(void* p)
+{
+#ifdef USE_PTHREADS
+    ThreadPool& pool = *(ThreadPool*)p;
+    Impl& impl = *pool.impl;
+
+    unsigned seen = 0;
+    pthread_mutex_lock(&impl.lock);
+    for(;;)
+    {
+        while(!impl.quit && impl.batch == seen)
+            pthread_cond_wait(&impl.start, &impl.lock);
+        if(impl.quit) break;
+        seen = impl.batch;
+
+        pthread_mutex_unlock(&impl.lock);
+        pool.Work();
+        pthread_mutex_lock(&impl.lock);
+    }
+    pthread_mutex_unlock(&impl.lock);
+#endif
+    return p;
+}
+
+unsigned ThreadPool::GetCPUcount()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n > 0) return (unsigned)n;
+#endif
+    return 1;
+}
@@ -0,0 +1,53 @@
+#ifndef bqtThreadPoolHH
+#define bqtThreadPoolHH
+
+/* A fixed set of worker threads for running numbered jobs.
+ *
+ * Run() calls the job for each number 0..count-1, spread
+ * over the threads, and returns when all of them are done.
+ * With one thread (or without pthreads), the jobs are
+ * simply run in order by the caller.
+ */
+class ThreadPool
+{
+public:
+    typedef void (*JobFunc)(void* arg, unsigned jobno);
+
+    explicit ThreadPool(unsigned num_threads);
+    ~ThreadPool();
+
+    void Run(JobFunc job, void* arg, unsigned count);
+
+    /* Calls func(n) for each n in 0..count-1 */
+    template<typename Func>
+    void RunEach(Func& func, unsigned count)
+    {
+        Run(&CallFunc<Func>, (void*)&func, count);
+    }
+
+    unsigned GetThreadCount() const { return num_threads; }
+
+    /* The number of processors online, at least 1 */
+    static unsigned GetCPUcount();
+
+private:
+    template<typename Func>
+    static void CallFunc(void* arg, unsigned jobno)
+    {
+        (*(Func*)arg)(jobno);
+    }
+
+    static void* ThreadMain(void* pool);
+    void Work();
+
+    unsigned num_threads;
+
+    class Impl;
+    Impl* impl;
+
+private:
+    ThreadPool(const ThreadPool&);
+    void operator=(const ThreadPool&);
+};
+
+#endif